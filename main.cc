@@ -1,14 +1,41 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <SDL.h>
 #include <time.h>
+#include <signal.h>
+
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+
+#include "shm_ring.h"
+#endif
+
+#ifdef __linux__
+#include <errno.h>
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#endif
 
 #include <string>
 #include <chrono>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <vector>
+#include <algorithm>
+#include <atomic>
 
-static const int FPS = 40;
-//static const int FPS = 2;
+static const int STEPS_PER_SECOND = 5; /**< Simulation rate, independent of the rendering rate. */
+static const int DEFAULT_FPS = 60; /**< Rendering rate when the display does not report its refresh rate. */
 
 enum GameEvent {
     EVENT_END_GAME,
@@ -21,6 +48,43 @@ enum GameEvent {
     EVENT_BTN_SPECIAL_UP
 };
 
+/**
+ * Input for one game step, as it is stored in replays.
+ */
+const uint8_t INPUT_DIR_MASK = 7;   /**< Direction of the move. */
+const uint8_t INPUT_SPECIAL = 8;    /**< Special button is down. */
+const uint8_t INPUT_END_GAME = 16;  /**< Game has been ended by the player before this step. */
+
+/**
+ * Dispatch recorded input to the game, in the same order as the drawer does it.
+ */
+template <class Game>
+void dispatch_input(Game *game, uint8_t input) {
+    static const GameEvent moves[] = { EVENT_MOVE_NONE, EVENT_MOVE_UP, EVENT_MOVE_DOWN, EVENT_MOVE_LEFT, EVENT_MOVE_RIGHT };
+
+    if (input & INPUT_END_GAME) {
+        game->dispatch_event(EVENT_END_GAME);
+    }
+
+    game->dispatch_event(moves[(input & INPUT_DIR_MASK) % 5]);
+    game->dispatch_event((input & INPUT_SPECIAL) ? EVENT_BTN_SPECIAL_DOWN : EVENT_BTN_SPECIAL_UP);
+}
+
+/**
+ * Advance the 64-bit LCG state and return its upper 31 bits, the low bits of an LCG are not random.
+ */
+static uint32_t random_next(uint64_t &rng) {
+    rng = rng * 6364136223846793005ull + 1442695040888963407ull;
+    return (uint32_t)(rng >> 33);
+}
+
+/**
+ * Random move for random players and benchmarks, as input of dispatch_input(). Special and end of game are not used.
+ */
+static uint8_t random_input(uint64_t &rng) {
+    return random_next(rng) % 5;
+}
+
 enum FieldType {
     FT_EMPTY,
     FT_ZONK,
@@ -91,6 +155,8 @@ const unsigned int HINT_PUSH = 32768; /**< Murphy pushing object */
 
 const int EXPLOSION_STEPS = 3;
 
+struct SaveState;
+
 struct Point {
     int x;
     int y;
@@ -105,7 +171,7 @@ struct Field {
     unsigned int hint;
     int countdown;
 
-    Field(): type(FT_EMPTY), hint(HINT_NONE) {}
+    Field(): type(FT_EMPTY), hint(HINT_NONE), countdown(0) {}
 
     void set_hint(unsigned int h) {
         hint |= h;
@@ -250,6 +316,473 @@ struct Field {
     }
 };
 
+/**
+ * Cell trace records every change of a field's type, hints or countdown made by Murphy's move, falling objects,
+ * NPC moves and explosions. Records are fixed size and go into a static ring buffer, so tracing does not allocate and
+ * can stay enabled. The ring is written to CELL_TRACE_FILE when the game crashes, --decode-trace prints it.
+ * Build with -DCELL_TRACE=0 to compile it out completely.
+ *
+ * The ring is shared by all Levels of the process, records tell their games apart by the game id. It is not locked,
+ * game_step() of all Levels must run on one thread.
+ */
+#ifndef CELL_TRACE
+#define CELL_TRACE 1
+#endif
+
+#if CELL_TRACE
+static const char *CELL_TRACE_FILE = "CELLTRACE.BIN";
+#endif
+
+enum CellTraceSource {
+    TRACE_MURPHY,
+    TRACE_FALL,
+    TRACE_NPC,
+    TRACE_EXPLOSION
+};
+
+struct CellTraceRecord {
+    uint32_t game;      /**< Id of the game, every loaded level or state gets a new one. */
+    uint32_t step;
+    uint16_t cell;      /**< Index of the field in level data. */
+    uint8_t source;     /**< CellTraceSource */
+    uint8_t reserved;
+    uint8_t old_type;
+    uint8_t new_type;
+    uint16_t old_hint;
+    uint16_t new_hint;
+    int16_t countdown;  /**< Countdown after the change. */
+};
+
+static_assert(sizeof(CellTraceRecord) == 20, "Cell trace record must stay 20 bytes.");
+
+/**
+ * Header of dumped trace, records follow it.
+ */
+struct CellTraceHeader {
+    static const uint32_t MAGIC = 0x52544353; /**< "SCTR" */
+
+    uint32_t magic;
+    uint32_t record_size;
+    uint32_t count;      /**< Number of records that follow, oldest first. */
+    uint32_t reserved;
+    uint64_t total;      /**< Number of records ever traced. */
+};
+
+#if CELL_TRACE
+class CellTrace {
+public:
+    static const uint32_t CAPACITY = 1 << 16; /**< Number of records kept, must be power of two. */
+
+    static void record(uint32_t game, uint32_t step, int cell, CellTraceSource source, uint8_t old_type,
+        uint16_t old_hint, const Field &field)
+    {
+        CellTraceRecord &r = records[head++ & (CAPACITY - 1)];
+        r.game = game;
+        r.step = step;
+        r.cell = cell;
+        r.source = source;
+        r.reserved = 0;
+        r.old_type = old_type;
+        r.new_type = field.type;
+        r.old_hint = old_hint;
+        r.new_hint = field.hint;
+        r.countdown = field.countdown;
+    }
+
+    /**
+     * Write the ring to file. Uses only async-signal-safe calls, so it can be called from a signal handler.
+     */
+    static bool dump(const char *file_name) {
+        CellTraceHeader header;
+        header.magic = CellTraceHeader::MAGIC;
+        header.record_size = sizeof(CellTraceRecord);
+        header.count = head < CAPACITY ? head : CAPACITY;
+        header.reserved = 0;
+        header.total = head;
+
+        uint32_t first = (head - header.count) & (CAPACITY - 1);
+        uint32_t tail = std::min(header.count, CAPACITY - first);
+
+#ifndef _WIN32
+        int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            return false;
+        }
+
+        bool ok = write(fd, &header, sizeof(header)) == (ssize_t)sizeof(header)
+            && write(fd, records + first, tail * sizeof(CellTraceRecord)) == (ssize_t)(tail * sizeof(CellTraceRecord))
+            && write(fd, records, (header.count - tail) * sizeof(CellTraceRecord))
+                == (ssize_t)((header.count - tail) * sizeof(CellTraceRecord));
+
+        return close(fd) == 0 && ok;
+#else
+        FILE *f;
+        if (fopen_s(&f, file_name, "wb") != 0) {
+            return false;
+        }
+
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+            && fwrite(records + first, sizeof(CellTraceRecord), tail, f) == tail
+            && fwrite(records, sizeof(CellTraceRecord), header.count - tail, f) == header.count - tail;
+
+        return fclose(f) == 0 && ok;
+#endif
+    }
+
+    /**
+     * Id for a new game. Levels may be loaded on other threads than the one that steps them.
+     */
+    static uint32_t next_game() {
+        return ++games;
+    }
+
+    /**
+     * Dump the trace when the process crashes or aborts.
+     */
+    static void install_crash_handler() {
+        for (int sig : {SIGSEGV, SIGABRT, SIGFPE, SIGILL}) {
+            signal(sig, crash_handler);
+        }
+    }
+
+protected:
+    static CellTraceRecord records[CAPACITY];
+    static uint64_t head;
+    static std::atomic<uint32_t> games;
+
+    static void crash_handler(int sig) {
+        dump(CELL_TRACE_FILE);
+
+        signal(sig, SIG_DFL);
+        raise(sig);
+    }
+};
+
+CellTraceRecord CellTrace::records[CellTrace::CAPACITY];
+uint64_t CellTrace::head = 0;
+std::atomic<uint32_t> CellTrace::games(0);
+
+/**
+ * Trace changes made by the rest of the enclosing block to given fields, or to 3x3 fields around given point.
+ */
+#define TRACE_FIELDS(source, ...) TraceScope cell_trace(this, source, { __VA_ARGS__ })
+#define TRACE_AREA(source, center) TraceScope cell_trace(this, source, center)
+#else
+#define TRACE_FIELDS(source, ...)
+#define TRACE_AREA(source, center)
+#endif
+
+/**
+ * Change of one field made by a game step, see Level::changes().
+ */
+struct CellChange {
+    uint16_t cell;         /**< Index of the field in level data. */
+    uint8_t old_type;
+    uint8_t new_type;
+    uint16_t hint_changed; /**< Hints that were set or cleared, new hints are old hints ^ hint_changed. */
+    uint8_t countdown;     /**< New countdown. */
+    uint8_t reserved;
+};
+
+/**
+ * Number of Murphy's moves from every field to the nearest target field (infotron, exit), so "how far is the
+ * nearest target and which way" is a lookup at Murphy's position. Murphy passes only through fields he can enter
+ * in this engine: empty, base, infotron and red disk.
+ *
+ * After a game step only the fields whose type has changed are repaired: distances that lost their support are
+ * cleared first, then the cleared and changed fields are filled again from their neighbours.
+ */
+class DistanceField {
+public:
+    static const uint16_t UNREACHABLE = 0xffff;
+
+    DistanceField(): width(0), height(0), target_type(FT_EMPTY) {}
+
+    bool enabled() const {
+        return !dist.empty();
+    }
+
+    /**
+     * Compute all distances to fields of target type from scratch. Rows of data are stride fields apart.
+     */
+    void rebuild(const Field *data, int width, int height, int stride, FieldType target_type) {
+        this->width = width;
+        this->height = height;
+        this->target_type = target_type;
+
+        int count = width * height;
+        dist.assign(count, (uint16_t)UNREACHABLE);
+        state.resize(count);
+        buckets.clear();
+
+        std::vector<int> queue;
+        queue.reserve(count);
+
+        for (int i = 0; i < count; ++i) {
+            state[i] = classify(data[i / width * stride + i % width].type);
+            if (state[i] & TARGET) {
+                dist[i] = 0;
+                queue.push_back(i);
+            }
+        }
+
+        for (size_t head = 0; head < queue.size(); ++head) {
+            int cell = queue[head];
+            for_neighbours(cell, [&](int n) {
+                if ((state[n] & (PASSABLE | TARGET)) == PASSABLE && dist[n] == UNREACHABLE) {
+                    dist[n] = dist[cell] + 1;
+                    queue.push_back(n);
+                }
+            });
+        }
+    }
+
+    /**
+     * Repair distances after fields listed in changes have changed.
+     */
+    void update(const std::vector<CellChange> &changes) {
+        changed.clear();
+        raised.clear();
+
+        for (const CellChange &change : changes) {
+            if (change.old_type == change.new_type) {
+                continue;
+            }
+
+            uint8_t now = classify((FieldType)change.new_type);
+            if (now != state[change.cell]) {
+                state[change.cell] = now;
+                changed.push_back(change.cell);
+            }
+        }
+
+        if (changed.empty()) {
+            return;
+        }
+
+        // Clear fields whose distance is not supported any more, and everything that depended on them.
+        for (int cell : changed) {
+            if (dist[cell] != UNREACHABLE && expected(cell) > dist[cell]) {
+                raise(cell);
+            }
+        }
+
+        for (size_t i = 0; i < raised.size(); ++i) {
+            int cell = raised[i].cell;
+            uint16_t old = raised[i].old;
+
+            for_neighbours(cell, [&](int n) {
+                if (dist[n] == old + 1 && !(state[n] & TARGET) && !supported(n)) {
+                    raise(n);
+                }
+            });
+        }
+
+        // Fill cleared and changed fields from their neighbours, then propagate lower distances.
+        for (int cell : changed) {
+            lower(cell, expected(cell));
+        }
+
+        for (const Raised &r : raised) {
+            lower(r.cell, expected(r.cell));
+        }
+
+        for (size_t d = 0; d < buckets.size(); ++d) {
+            for (size_t i = 0; i < buckets[d].size(); ++i) {
+                int cell = buckets[d][i];
+                if (dist[cell] != d) {
+                    continue;
+                }
+
+                for_neighbours(cell, [&](int n) {
+                    if ((state[n] & (PASSABLE | TARGET)) == PASSABLE) {
+                        lower(n, d + 1);
+                    }
+                });
+            }
+
+            buckets[d].clear();
+        }
+    }
+
+    uint16_t distance(int cell) const {
+        return dist[cell];
+    }
+
+    /**
+     * Direction of the first move on a shortest path from given field, DIR_NONE when on target or unreachable.
+     */
+    Direction direction(int cell) const {
+        static const Direction dirs[] = { DIR_UP, DIR_DOWN, DIR_LEFT, DIR_RIGHT };
+
+        Direction best = DIR_NONE;
+        uint16_t best_dist = dist[cell];
+        int i = 0;
+
+        for_neighbours(cell, [&](int n) {
+            if (dist[n] < best_dist) {
+                best_dist = dist[n];
+                best = dirs[i];
+            }
+            ++i;
+        });
+
+        return best;
+    }
+
+protected:
+    static const uint8_t PASSABLE = 1;
+    static const uint8_t TARGET = 2;
+
+    struct Raised {
+        int cell;
+        uint16_t old;
+    };
+
+    int width;
+    int height;
+    FieldType target_type;
+
+    std::vector<uint16_t> dist;
+    std::vector<uint8_t> state;                /**< PASSABLE and TARGET flags of every field. */
+    std::vector<int> changed;
+    std::vector<Raised> raised;
+    std::vector<std::vector<int>> buckets;     /**< Fields to propagate from, by distance. */
+
+    uint8_t classify(FieldType type) const {
+        uint8_t result = type == target_type ? TARGET : 0;
+
+        switch (type) {
+            case FT_EMPTY:
+            case FT_BASE:
+            case FT_INFOTRON:
+            case FT_RED_DISK:
+            case FT_MURPHY:
+                result |= PASSABLE;
+                break;
+
+            default:
+                break;
+        }
+
+        return result;
+    }
+
+    /**
+     * Up, down, left, right, fields on the level edge have fewer neighbours.
+     */
+    template <class F>
+    void for_neighbours(int cell, F f) const {
+        int x = cell % width;
+        int y = cell / width;
+
+        if (y > 0) f(cell - width);
+        if (y < height - 1) f(cell + width);
+        if (x > 0) f(cell - 1);
+        if (x < width - 1) f(cell + 1);
+    }
+
+    /**
+     * Distance of the field as given by its neighbours.
+     */
+    uint16_t expected(int cell) const {
+        if (state[cell] & TARGET) {
+            return 0;
+        }
+
+        if (!(state[cell] & PASSABLE)) {
+            return UNREACHABLE;
+        }
+
+        uint16_t best = UNREACHABLE;
+        for_neighbours(cell, [&](int n) {
+            best = std::min(best, dist[n]);
+        });
+
+        return best == UNREACHABLE ? UNREACHABLE : best + 1;
+    }
+
+    bool supported(int cell) const {
+        bool found = false;
+        for_neighbours(cell, [&](int n) {
+            found |= dist[n] + 1 == dist[cell];
+        });
+
+        return found;
+    }
+
+    void raise(int cell) {
+        raised.push_back(Raised{cell, dist[cell]});
+        dist[cell] = UNREACHABLE;
+    }
+
+    void lower(int cell, uint16_t d) {
+        if (d < dist[cell]) {
+            dist[cell] = d;
+
+            if (buckets.size() <= d) {
+                buckets.resize(d + 1);
+            }
+            buckets[d].push_back(cell);
+        }
+    }
+};
+
+/**
+ * What the simulation did, either in one game step or summed over more of them. Maintained by the Level itself,
+ * plain counters so they cost next to nothing.
+ */
+struct SimCounters {
+    uint64_t steps = 0;
+    uint64_t cells_processed = 0;    /**< Fields visited by the NPC pass. */
+    uint64_t cells_skipped = 0;      /**< Fields skipped by the NPC pass because of HINT_SKIP. */
+    uint64_t falls = 0;
+    uint64_t rolls_left = 0;
+    uint64_t rolls_right = 0;
+    uint64_t pushes = 0;
+    uint64_t explosions = 0;         /**< All explosions, including the cascaded ones. */
+    uint64_t explosion_cascades = 0; /**< Explosions started by another explosion. */
+    uint64_t npc_moves = 0;
+    uint64_t npc_turns = 0;
+    uint64_t murphy_moves = 0;
+    uint64_t murphy_blocked = 0;     /**< Murphy wanted to move, but could not. */
+
+    struct Counter {
+        const char *name;
+        uint64_t SimCounters::*value;
+    };
+
+    static const int COUNTER_COUNT = 13;
+    static const Counter COUNTERS[COUNTER_COUNT];
+
+    SimCounters &operator+=(const SimCounters &other) {
+        for (int i = 0; i < COUNTER_COUNT; ++i) {
+            this->*COUNTERS[i].value += other.*COUNTERS[i].value;
+        }
+
+        return *this;
+    }
+};
+
+const SimCounters::Counter SimCounters::COUNTERS[SimCounters::COUNTER_COUNT] = {
+    { "steps", &SimCounters::steps },
+    { "cells_processed", &SimCounters::cells_processed },
+    { "cells_skipped", &SimCounters::cells_skipped },
+    { "falls", &SimCounters::falls },
+    { "rolls_left", &SimCounters::rolls_left },
+    { "rolls_right", &SimCounters::rolls_right },
+    { "pushes", &SimCounters::pushes },
+    { "explosions", &SimCounters::explosions },
+    { "explosion_cascades", &SimCounters::explosion_cascades },
+    { "npc_moves", &SimCounters::npc_moves },
+    { "npc_turns", &SimCounters::npc_turns },
+    { "murphy_moves", &SimCounters::murphy_moves },
+    { "murphy_blocked", &SimCounters::murphy_blocked },
+};
+
+static_assert(sizeof(SimCounters) == SimCounters::COUNTER_COUNT * sizeof(uint64_t),
+    "Every counter must be listed in SimCounters::COUNTERS.");
+
 class Level {
 public:
     static const int LEVEL_BYTES = 1536;
@@ -257,17 +790,32 @@ public:
     static const int LEVEL_HEIGHT = 24;
     static const int LEVEL_NAME_LENGTH = 23;
 
-    Field data[LEVEL_WIDTH * LEVEL_HEIGHT];
+    static const int STRIDE = LEVEL_WIDTH + 2; /**< Distance between vertically adjacent fields in the grid. */
+    static const int GRID_SIZE = STRIDE * (LEVEL_HEIGHT + 2);
+    static const int TIMER_WHEEL_SIZE = 16; /**< Timers are scheduled less than this many steps ahead. */
+
     bool gravitation, freeze_zonks;
     char title[LEVEL_NAME_LENGTH];
 
     bool murphy_alive;
     bool special_down;
+    bool murphy_moved; /**< Murphy has moved (or eaten something with special) during last game step. */
+    bool end_game_requested; /**< Player has ended the game, it will be recorded as part of next step's input. */
+    int infotrons_collected;
 
-    int end_game_timeout = 8;
+    SimCounters step_counters; /**< What the last game step did. */
+    SimCounters counters;      /**< What all game steps since the level was loaded did. */
+
+    int end_game_timeout = 8; /**< Number of steps the game continues after Murphy's death. */
 
 public:
-    Level(const char *file_name, int level): gravitation(false), freeze_zonks(false), murphy_alive(true) {
+    Level(const char *file_name, int level): gravitation(false), freeze_zonks(false), murphy_alive(true), special_down(false),
+        murphy_moved(false), end_game_requested(false), infotrons_collected(0), next_move(DIR_NONE), step_no(0), game_over(false)
+    {
+        init_grid();
+#if CELL_TRACE
+        trace_game = CellTrace::next_game();
+#endif
 
 #ifndef _WIN32
         FILE *f = fopen(file_name, "rb");
@@ -282,12 +830,12 @@ public:
             char databytes[LEVEL_WIDTH * LEVEL_HEIGHT];
             fread(databytes, sizeof(char), LEVEL_WIDTH * LEVEL_HEIGHT, f);
 
-            for (size_t i = 0; i < LEVEL_WIDTH * LEVEL_HEIGHT; ++i) {
-                data[i].coords = Point(i % LEVEL_WIDTH, i / LEVEL_WIDTH);
-                data[i].type = (FieldType)databytes[i];
+            for (int i = 0; i < LEVEL_WIDTH * LEVEL_HEIGHT; ++i) {
+                Field &fld = field(i);
+                fld.type = (FieldType)databytes[i];
 
-                if (data[i].type == FT_MURPHY) {
-                    murphy = data[i].coords;
+                if (fld.type == FT_MURPHY) {
+                    murphy = fld.coords;
                 }
             }
 
@@ -313,22 +861,43 @@ public:
         }
     }
 
+    /**
+     * Restore level from save state. The state must be validated.
+     */
+    explicit Level(const SaveState &state);
+
+    void save_state(SaveState &state) const;
+    void load_state(const SaveState &state);
+
+    /**
+     * Return number of levels in the level file.
+     */
+    static int level_count(const char *file_name) {
+        FILE *f = fopen(file_name, "rb");
+        if (!f) {
+            return 0;
+        }
+
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fclose(f);
+
+        return size / LEVEL_BYTES;
+    }
+
     bool game_step() {
-        //printf("Game step.\n");
+        step_counters = SimCounters();
+        step_counters.steps = 1;
 
-        //printf("Murphy at %dx%d.\n", murphy.x, murphy.y);
-        //printf("%s\n", data[data_idx(murphy)].to_string().c_str());
-        //printf("%s\n", data[data_idx(next_point(murphy, DIR_UP))].to_string().c_str());
-        //printf("%s\n", data[data_idx(next_point(murphy, DIR_DOWN))].to_string().c_str());
-        //printf("Field 36x13: %s\n", data[data_idx(Point(36, 13))].to_string().c_str());
-        //printf("Field 36x14: %s\n", data[data_idx(Point(36, 14))].to_string().c_str());
+        bool allow_move = false;
 
         if (next_move != DIR_NONE && murphy_alive) {
-            Point next = next_point(murphy, next_move);
-            Field &fld = data[data_idx(next)];
-			Field &murphy_fld = data[data_idx(murphy)];
+			Field &murphy_fld = grid[grid_index(murphy)];
+            Field &fld = neighbour(murphy_fld, next_move);
 
-            bool allow_move = false;
+            TRACE_FIELDS(TRACE_MURPHY, &murphy_fld, &fld);
+            touch(murphy_fld);
+            touch(fld);
 
 			murphy_fld.del_hint(HINT_PUSH);
 
@@ -348,6 +917,7 @@ public:
 
                 case FT_INFOTRON:
                     // TODO: Eat infotron
+                    ++infotrons_collected;
                     fld.set_hint(HINT_WAS_INFOTRON);
                     allow_move = true;
                     break;
@@ -371,8 +941,9 @@ public:
 
 					// Allow pushing only to left or right, and yellow disk in any direction.
 					} else if (fld.type == FT_YELLOW_DISK || next_move == DIR_LEFT || next_move == DIR_RIGHT) {
-						Point more = next_point(next, next_move);
-						Field &fld_more = data[data_idx(more)];
+						Field &fld_more = neighbour(fld, next_move);
+						TRACE_FIELDS(TRACE_MURPHY, &fld_more);
+						touch(fld_more);
 
 						if (fld_more.type == FT_EMPTY && !fld_more.has_hint(HINT_LEAVING)) {
 							murphy_fld.set_hint(HINT_PUSH);
@@ -380,6 +951,7 @@ public:
 								fld_more.type = fld.type;
 								fld_more.set_hint(hint_from_direction(next_move) | HINT_SKIP);
 								allow_move = true;
+								++step_counters.pushes;
 								murphy_fld.countdown = 0;
 							}
 							else {
@@ -400,7 +972,7 @@ public:
 			}
 
             if (allow_move) {
-                Field &origin = data[data_idx(murphy)];
+                Field &origin = murphy_fld;
                 if (!special_down) {
                     origin.type = FT_EMPTY;
                     origin.set_hint(HINT_LEAVING | HINT_SKIP);
@@ -414,105 +986,172 @@ public:
     					origin.del_hint(HINT_PUSH);
     				}
 
-                    murphy = next;
+                    murphy = fld.coords;
                 } else {
                     fld.type = FT_EMPTY;
                     fld.set_hint(HINT_SKIP | HINT_LEAVING);
                 }
+
+                ++step_counters.murphy_moves;
+            } else {
+                ++step_counters.murphy_blocked;
             }
         }
         next_move = DIR_NONE;
+        murphy_moved = allow_move;
+
+        for (int y = 0; y < height(); ++y) {
+            int end = grid_index(Point(width(), y));
+            for (int i = grid_index(Point(0, y)); i < end; ++i) {
+                Field &field = grid[i];
+                if (field.has_hint(HINT_SKIP)) {
+                    continue;
+                }
 
-		for (int i = 0; i < width() * height(); ++i) {
-			Field &field = data[i];
-			if (field.has_hint(HINT_SKIP)) {
-				continue;
-			}
+                if (field.has_hint(HINT_LEAVING)) {
+                    touch(field);
+                    field.del_hint(HINT_LEAVING | HINT_WAS_BASE | HINT_WAS_INFOTRON | HINT_WAS_RED_DISK);
+                }
+            }
+        }
 
-			if (field.has_hint(HINT_LEAVING)) {
-    		    field.del_hint(HINT_LEAVING | HINT_WAS_BASE | HINT_WAS_INFOTRON | HINT_WAS_RED_DISK);
-			}
-		}
+        // Timers due in this step, processed in the order of fields, together with NPC actions.
+        std::vector<int> &due = timers[step_no % TIMER_WHEEL_SIZE];
+        std::sort(due.begin(), due.end());
+
+        size_t next_due = 0;
+        while (next_due < due.size() && due[next_due] == TIMER_GAME_OVER) {
+            game_over = true;
+            ++next_due;
+        }
 
         // Do NPC actions
-        for (int i = 0; i < width() * height(); ++i) {
-            Field &field = data[i];
-            if (field.has_hint(HINT_SKIP)) {
-                continue;
-            }
+        for (int y = 0; y < height(); ++y) {
+            int end = grid_index(Point(width(), y));
+            for (int i = grid_index(Point(0, y)); i < end; ++i) {
+                Field &field = grid[i];
 
-            // NPC direction must be determined here.
-            Direction dir = DIR_UP;
-            if (field.has_hint(HINT_FROM_BOTTOM)) {
-                dir = DIR_UP;
-            } else if (field.has_hint(HINT_FROM_TOP)) {
-                dir = DIR_DOWN;
-            } else if (field.has_hint(HINT_FROM_LEFT)) {
-                dir = DIR_RIGHT;
-            } else if (field.has_hint(HINT_FROM_RIGHT)) {
-                dir = DIR_LEFT;
-            }
+                while (next_due < due.size() && due[next_due] < i) {
+                    ++next_due;
+                }
 
-            // Remove hints from Murphy's movement.
-            if (field.type != FT_SNIK_SNAK && field.type != FT_ELECTRON) {
-                field.del_hint(HINT_FROM_BOTTOM | HINT_FROM_TOP | HINT_FROM_RIGHT | HINT_FROM_LEFT);
-            }
+                bool timer_due = next_due < due.size() && due[next_due] == i;
 
-            field.del_hint(HINT_WAS_BASE | HINT_WAS_INFOTRON | HINT_WAS_RED_DISK);
+                if (field.has_hint(HINT_SKIP)) {
+                    // Exploding field is untouchable in this step, explosion continues in the next one.
+                    if (timer_due && field.has_hint(HINT_EXPLOSION | HINT_EXPLOSION_INFOTRON)) {
+                        schedule(1, i);
+                    }
 
-            if (field.has_hint(HINT_EXPLOSION) || field.has_hint(HINT_EXPLOSION_INFOTRON)) {
-                if (field.countdown > 0) {
-                    if (field.countdown == EXPLOSION_STEPS && !field.has_hint(HINT_EXPLOSION_ORIGIN)) {
-                        // Test whether we don't need to cascade explode.
-                        if (field.explodes()) {
-                            explode_9(field, field.explodes_into());
+                    ++step_counters.cells_skipped;
+                    continue;
+                }
+
+                ++step_counters.cells_processed;
+
+                // NPC direction must be determined here.
+                Direction dir = DIR_UP;
+                if (field.has_hint(HINT_FROM_BOTTOM)) {
+                    dir = DIR_UP;
+                } else if (field.has_hint(HINT_FROM_TOP)) {
+                    dir = DIR_DOWN;
+                } else if (field.has_hint(HINT_FROM_LEFT)) {
+                    dir = DIR_RIGHT;
+                } else if (field.has_hint(HINT_FROM_RIGHT)) {
+                    dir = DIR_LEFT;
+                }
+
+                // Remove hints from Murphy's movement.
+                unsigned int murphy_hints = HINT_WAS_BASE | HINT_WAS_INFOTRON | HINT_WAS_RED_DISK;
+                if (field.type != FT_SNIK_SNAK && field.type != FT_ELECTRON) {
+                    murphy_hints |= HINT_FROM_BOTTOM | HINT_FROM_TOP | HINT_FROM_RIGHT | HINT_FROM_LEFT;
+                }
+
+                if (field.has_hint(murphy_hints)) {
+                    touch(field);
+                    field.del_hint(murphy_hints);
+                }
+
+                if (timer_due && field.has_hint(HINT_EXPLOSION | HINT_EXPLOSION_INFOTRON)) {
+                    TRACE_FIELDS(TRACE_EXPLOSION, &field);
+                    touch(field);
+
+                    if (field.countdown > 0) {
+                        if (field.countdown == EXPLOSION_STEPS && !field.has_hint(HINT_EXPLOSION_ORIGIN)) {
+                            // Test whether we don't need to cascade explode.
+                            if (field.explodes()) {
+                                ++step_counters.explosion_cascades;
+                                explode_9(field, field.explodes_into());
+                            }
                         }
-                    }
 
-                    field.countdown -= 1;
-					field.set_hint(HINT_SKIP);
-                } else {
-                    if (field.has_hint(HINT_EXPLOSION)) {
-                        field.type = FT_EMPTY;
-                        field.del_hint(HINT_EXPLOSION);
-                    } else if (field.has_hint(HINT_EXPLOSION_INFOTRON)) {
-                        field.type = FT_INFOTRON;
-                        field.del_hint(HINT_EXPLOSION_INFOTRON);
-                    }
+                        field.countdown -= 1;
+                        field.set_hint(HINT_SKIP);
+                        schedule(1, i);
+                    } else {
+                        if (field.has_hint(HINT_EXPLOSION)) {
+                            field.type = FT_EMPTY;
+                            field.del_hint(HINT_EXPLOSION);
+                        } else if (field.has_hint(HINT_EXPLOSION_INFOTRON)) {
+                            field.type = FT_INFOTRON;
+                            field.del_hint(HINT_EXPLOSION_INFOTRON);
+                        }
 
-                    field.del_hint(HINT_EXPLOSION_ORIGIN);
+                        field.del_hint(HINT_EXPLOSION_ORIGIN);
+
+                        // Field hit by both kinds of explosion finishes the other one in the next step.
+                        if (field.has_hint(HINT_EXPLOSION_INFOTRON)) {
+                            schedule(1, i);
+                        }
+                    }
                 }
-            }
 
-			if (!field.has_hint(HINT_SKIP)) {
-				switch (field.type) {
-				case FT_ZONK:
-				case FT_INFOTRON:
-					fall(field, false);
-					break;
+                if (!field.has_hint(HINT_SKIP)) {
+                    switch (field.type) {
+                    case FT_ZONK:
+                    case FT_INFOTRON:
+                        fall(field, false);
+                        break;
 
-				case FT_ORANGE_DISK:
-					fall(field, true);
-					break;
+                    case FT_ORANGE_DISK:
+                        fall(field, true);
+                        break;
 
-				case FT_SNIK_SNAK:
-				case FT_ELECTRON:
-					move_npc(field, dir);
-					break;
+                    case FT_SNIK_SNAK:
+                    case FT_ELECTRON:
+                        move_npc(field, dir);
+                        break;
 
-				default:
-					break;
-				}
-			}
+                    default:
+                        break;
+                    }
+                }
+            }
         }
 
         // Skip is used only for current game step. Clear it for next one.
-        for (int i = 0; i < width() * height(); ++i) {
-            Field &field = data[i];
-            field.del_hint(HINT_SKIP);
+        for (int y = 0; y < height(); ++y) {
+            int end = grid_index(Point(width(), y));
+            for (int i = grid_index(Point(0, y)); i < end; ++i) {
+                grid[i].del_hint(HINT_SKIP);
+            }
         }
 
-        return murphy_alive || (end_game_timeout-- > 0);
+        write_journal();
+
+        if (infotron_distances.enabled()) {
+            infotron_distances.update(journal);
+            exit_distances.update(journal);
+        }
+
+        end_game_requested = false;
+
+        due.clear();
+        ++step_no;
+
+        counters += step_counters;
+
+        return !game_over;
     }
 
     void dispatch_event(GameEvent event) {
@@ -543,7 +1182,12 @@ public:
                 break;
 
             case EVENT_END_GAME:
-                explode_9(data[data_idx(murphy)], FT_EMPTY);
+                end_game_requested = true;
+                explode_9(grid[grid_index(murphy)], FT_EMPTY);
+
+                // Explosion happens between steps, the last step is already added to counters.
+                --step_counters.explosions;
+                ++counters.explosions;
                 break;
 
             case EVENT_BTN_SPECIAL_DOWN:
@@ -556,753 +1200,6778 @@ public:
         }
     }
 
-    int width() const {
+    static constexpr int width() {
         return LEVEL_WIDTH;
     }
 
-    int height() const {
+    static constexpr int height() {
         return LEVEL_HEIGHT;
     }
 
-protected:
-    Direction next_move;
-    Point murphy;
+    /**
+     * Field of the level, x and y within width() and height().
+     */
+    Field &field(int x, int y) {
+        return grid[grid_index(Point(x, y))];
+    }
 
-    Point next_point(Point current, Direction dir) const {
-        switch (dir) {
-            case DIR_UP:
-                if (current.y > 0) {
-                    return Point(current.x, current.y - 1);
-                } else {
-                    return current;
-                }
-                break;
+    const Field &field(int x, int y) const {
+        return grid[grid_index(Point(x, y))];
+    }
 
-            case DIR_DOWN:
-                if (current.y < height() - 1) {
-                    return Point(current.x, current.y + 1);
-                } else {
-                    return current;
-                }
-                break;
+    /**
+     * Field by its index in level data (y * width() + x), as used by save states, journal and published state.
+     */
+    Field &field(int i) {
+        return field(i % LEVEL_WIDTH, i / LEVEL_WIDTH);
+    }
 
-            case DIR_LEFT:
-                if (current.x > 0) {
-                    return Point(current.x - 1, current.y);
-                } else {
-                    return current;
-                }
-                break;
+    const Field &field(int i) const {
+        return field(i % LEVEL_WIDTH, i / LEVEL_WIDTH);
+    }
 
-            case DIR_RIGHT:
-                if (current.x < width() - 1) {
-                    return Point(current.x + 1, current.y);
-                } else {
-                    return current;
-                }
-                break;
+    Point murphy_position() const {
+        return murphy;
+    }
 
-            default:
-                break;
+    /**
+     * Hash of all fields. Equal fields give equal fingerprints, different ones rarely do. Costs a scan of the level,
+     * about as much as the end of a game step.
+     */
+    uint64_t fingerprint() const {
+        uint64_t hash = 0;
+
+        int n = 0;
+        for (int y = 0; y < height(); ++y) {
+            int end = grid_index(Point(width(), y));
+            for (int i = grid_index(Point(0, y)); i < end; ++i, ++n) {
+                hash += fingerprint_term(grid[i], n);
+            }
         }
 
-        return current;
+        return hash;
     }
 
-    int data_idx(Point p) const {
-        return p.y * width() + p.x;
+    /**
+     * Start keeping the journal of fields changed by each game step.
+     */
+    void enable_journal() {
+        if (journal_enabled()) {
+            return;
+        }
+
+        shadow.resize(LEVEL_WIDTH * LEVEL_HEIGHT);
+        touched.reserve(LEVEL_WIDTH * LEVEL_HEIGHT);
+        journal.reserve(LEVEL_WIDTH * LEVEL_HEIGHT);
+        sync_journal();
     }
 
-	unsigned int hint_from_direction(Direction dir) {
-		switch (dir) {
-		case DIR_NONE:
-			return HINT_NONE;
-		case DIR_LEFT:
-			return HINT_FROM_RIGHT;
-		case DIR_RIGHT:
-			return HINT_FROM_LEFT;
-		case DIR_UP:
-			return HINT_FROM_BOTTOM;
-		case DIR_DOWN:
-			return HINT_FROM_TOP;
-		}
-	}
+    bool journal_enabled() const {
+        return !shadow.empty();
+    }
 
-	Direction turn_left(const Direction &dir) {
-		switch (dir) {
-		case DIR_NONE:
-			return DIR_NONE;
-		case DIR_LEFT:
-			return DIR_DOWN;
-		case DIR_RIGHT:
-			return DIR_UP;
-		case DIR_UP:
-			return DIR_LEFT;
-		case DIR_DOWN:
-			return DIR_RIGHT;
-		}
-	}
+    /**
+     * Fields changed by the last game step (including changes made between steps, like ending the game), in field
+     * order. Valid until the next game step.
+     */
+    const std::vector<CellChange> &changes() const {
+        return journal;
+    }
 
-	Direction turn_right(const Direction &dir) {
-		switch (dir) {
-		case DIR_NONE:
-			return DIR_NONE;
-		case DIR_LEFT:
-			return DIR_UP;
-		case DIR_RIGHT:
-			return DIR_DOWN;
-		case DIR_UP:
-			return DIR_RIGHT;
-		case DIR_DOWN:
-			return DIR_LEFT;
-		}
-	}
+    /**
+     * Start maintaining distances to the nearest infotron and to the exit after every game step. Enables the journal.
+     */
+    void enable_distance_fields() {
+        enable_journal();
+        infotron_distances.rebuild(&field(0, 0), LEVEL_WIDTH, LEVEL_HEIGHT, STRIDE, FT_INFOTRON);
+        exit_distances.rebuild(&field(0, 0), LEVEL_WIDTH, LEVEL_HEIGHT, STRIDE, FT_EXIT);
+    }
 
-	Direction turn_back(const Direction &dir) {
-		switch (dir) {
-		case DIR_NONE:
-			return DIR_NONE;
-		case DIR_LEFT:
-			return DIR_RIGHT;
-		case DIR_RIGHT:
-			return DIR_LEFT;
-		case DIR_UP:
-			return DIR_DOWN;
-		case DIR_DOWN:
-			return DIR_UP;
-		}
-	}
+    /**
+     * Moves to the nearest infotron from every field, valid only after enable_distance_fields().
+     */
+    const DistanceField &infotron_distance() const {
+        return infotron_distances;
+    }
 
-    void fall(Field &fld, bool destructive) {
-        Point pt_below = next_point(fld.coords, DIR_DOWN);
-        Field &below = data[data_idx(pt_below)];
+    /**
+     * Moves to the exit from every field, valid only after enable_distance_fields().
+     */
+    const DistanceField &exit_distance() const {
+        return exit_distances;
+    }
 
-        switch (below.type) {
-            case FT_EMPTY:
-                if (!below.has_hint(HINT_LEAVING)) {
-                    below.type = fld.type;
-                    fld.type = FT_EMPTY;
-                    below.set_hint(HINT_FALL | HINT_SKIP);
-				}
-                break;
+    /**
+     * Number of game steps done since the level was loaded.
+     */
+    int steps_done() const {
+        return step_no;
+    }
 
-            case FT_MURPHY:
-            case FT_SNIK_SNAK:
-            case FT_ORANGE_DISK:
-                if (fld.has_hint(HINT_FALL) && (below.type != FT_MURPHY || !below.has_hint(HINT_LEAVING))) {
-                    explode_9(below, FT_EMPTY);
-                }
-                break;
+    /**
+     * Number of steps the game will continue, counting from the next one. Negative when the game is over.
+     */
+    int end_game_timeout_left() const {
+        if (murphy_alive) {
+            return end_game_timeout;
+        } else if (game_over) {
+            return -1;
+        }
 
-            case FT_ELECTRON:
-                if (fld.has_hint(HINT_FALL)) {
-                    explode_9(below, FT_INFOTRON);
-                }
-                break;
+        for (int delay = 0; delay < TIMER_WHEEL_SIZE; ++delay) {
+            const std::vector<int> &bucket = timers[(step_no + delay) % TIMER_WHEEL_SIZE];
+            if (std::find(bucket.begin(), bucket.end(), (int)TIMER_GAME_OVER) != bucket.end()) {
+                return delay;
+            }
+        }
 
-            default:
-                if (fld.has_hint(HINT_FALL) && destructive) {
-                    explode_9(fld, FT_EMPTY);
-                } else if (below.rolls_on_impact()) {
-                    Field &left = data[data_idx(next_point(fld.coords, DIR_LEFT))];
-                    Field &right = data[data_idx(next_point(fld.coords, DIR_RIGHT))];
-                    Field &lbelow = data[data_idx(next_point(left.coords, DIR_DOWN))];
-                    Field &rbelow = data[data_idx(next_point(right.coords, DIR_DOWN))];
+        return -1;
+    }
 
-                    // Roll left
-                    if (left.type == FT_EMPTY && lbelow.type == FT_EMPTY) {
-						if (!left.has_hint(HINT_LEAVING) && !lbelow.has_hint(HINT_LEAVING)) {
-							left.type = fld.type;
-							fld.type = FT_EMPTY;
-							left.set_hint(HINT_FROM_RIGHT | HINT_SKIP);
-						}
-                    }
+    /**
+     * Input that will be applied by next game step, encoded the same way as in replays.
+     */
+    uint8_t encode_input() const {
+        return next_move | (special_down ? INPUT_SPECIAL : 0) | (end_game_requested ? INPUT_END_GAME : 0);
+    }
 
-                    // Roll right
-                    else if (right.type == FT_EMPTY && rbelow.type == FT_EMPTY) {
-						if (!right.has_hint(HINT_LEAVING) && !rbelow.has_hint(HINT_LEAVING)) {
-							right.type = fld.type;
+protected:
+    static const int TIMER_GAME_OVER = -1; /**< Timer that is not bound to any field. */
+
+    /**
+     * Fields of the level surrounded by a ring of FT_BORDER guard fields, so every level field has all eight
+     * neighbours and moving in a direction is adding a constant offset. Guard fields never change their type and are
+     * not visited by game steps.
+     */
+    Field grid[GRID_SIZE];
+
+    static constexpr int OFFSETS[] = { 0, -STRIDE, STRIDE, -1, 1 }; /**< Grid offset of the neighbour by Direction. */
+
+    Direction next_move;
+    Point murphy;
+
+    int step_no; /**< Number of game steps done. */
+    bool game_over;
+
+#if CELL_TRACE
+    /**
+     * Traces changes made to given fields during its lifetime. Changes made by nested scope are traced only by the
+     * nested scope, changes the outer scopes made to its fields before it started are recorded when it starts.
+     */
+    class TraceScope {
+    public:
+        static const int MAX_FIELDS = 9;
+
+        TraceScope(Level *level, CellTraceSource source, std::initializer_list<Field *> fields): level(level),
+            source(source), parent(level->trace_scope), count(0)
+        {
+            for (Field *field : fields) {
+                add(field);
+            }
+
+            flush_outer();
+            level->trace_scope = this;
+        }
+
+        /**
+         * Trace 3x3 fields around center.
+         */
+        TraceScope(Level *level, CellTraceSource source, Point center): level(level), source(source),
+            parent(level->trace_scope), count(0)
+        {
+            for (int y = std::max(0, center.y - 1); y <= std::min(LEVEL_HEIGHT - 1, center.y + 1); ++y) {
+                for (int x = std::max(0, center.x - 1); x <= std::min(LEVEL_WIDTH - 1, center.x + 1); ++x) {
+                    add(&level->field(x, y));
+                }
+            }
+
+            flush_outer();
+            level->trace_scope = this;
+        }
+
+        ~TraceScope() {
+            for (int i = 0; i < count; ++i) {
+                record(entries[i]);
+            }
+
+            level->trace_scope = parent;
+            for (TraceScope *outer = parent; outer; outer = outer->parent) {
+                outer->refresh(*this);
+            }
+        }
+
+    protected:
+        struct Entry {
+            Field *field;
+            uint8_t type;
+            uint16_t hint;
+            int countdown;
+        };
+
+        Level *level;
+        CellTraceSource source;
+        TraceScope *parent;
+        int count;
+        Entry entries[MAX_FIELDS];
+
+        void add(Field *field) {
+            Entry &entry = entries[count++];
+            entry.field = field;
+            snapshot(entry);
+        }
+
+        static void snapshot(Entry &entry) {
+            entry.type = entry.field->type;
+            entry.hint = entry.field->hint;
+            entry.countdown = entry.field->countdown;
+        }
+
+        void record(const Entry &entry) const {
+            const Field &field = *entry.field;
+
+            if (field.type != entry.type || field.hint != entry.hint || field.countdown != entry.countdown) {
+                CellTrace::record(level->trace_game, level->step_no, level_index(&field - level->grid), source,
+                    entry.type, entry.hint, field);
+            }
+        }
+
+        /**
+         * Record what the outer scopes changed on fields of this scope so far and restart them from the current state.
+         * Change is recorded once, by the innermost scope tracing the field.
+         */
+        void flush_outer() {
+            for (int i = 0; i < count; ++i) {
+                bool recorded = false;
+                for (TraceScope *outer = parent; outer; outer = outer->parent) {
+                    for (int j = 0; j < outer->count; ++j) {
+                        Entry &entry = outer->entries[j];
+                        if (entry.field == entries[i].field) {
+                            if (!recorded) {
+                                outer->record(entry);
+                                recorded = true;
+                            }
+
+                            snapshot(entry);
+                        }
+                    }
+                }
+            }
+        }
+
+        /**
+         * Take changes traced by inner scope as the starting state, they are recorded already.
+         */
+        void refresh(const TraceScope &inner) {
+            for (int i = 0; i < count; ++i) {
+                for (int j = 0; j < inner.count; ++j) {
+                    if (entries[i].field == inner.entries[j].field) {
+                        snapshot(entries[i]);
+                    }
+                }
+            }
+        }
+    };
+
+    TraceScope *trace_scope = nullptr; /**< Innermost active trace scope. */
+    uint32_t trace_game = 0;           /**< Game id of the trace records. */
+#endif
+
+    /**
+     * Fields as they were after the last game step, touched ones are compared to the current ones when the journal is
+     * written. Empty when the journal is not enabled.
+     */
+    struct ShadowField {
+        uint8_t type;
+        uint8_t countdown;
+        uint16_t hint;
+        bool touched; /**< Field is listed in touched. */
+    };
+
+    std::vector<ShadowField> shadow;
+    std::vector<int> touched; /**< Grid indexes of fields changed since the journal has been written. */
+    std::vector<CellChange> journal;
+
+    /**
+     * Part of the fingerprint for field n. Terms of all fields are added, so they are independent of each other and
+     * the scan does not wait for a chain of multiplications.
+     */
+    static uint64_t fingerprint_term(const Field &field, int n) {
+        uint64_t x = (uint64_t)n << 40 | (uint64_t)(field.hint & 0xffff) << 16
+            | (uint64_t)(uint8_t)field.countdown << 8 | (uint8_t)field.type;
+        x *= 0x9e3779b97f4a7c15ull;
+        return x ^ (x >> 29);
+    }
+
+    DistanceField infotron_distances;
+    DistanceField exit_distances;
+
+    /**
+     * Mark field about to be changed, so the journal compares it with its shadow. Must be called before every change
+     * made to a field, in the step or between steps.
+     */
+    void touch(const Field &field) {
+        if (shadow.empty()) {
+            return;
+        }
+
+        int i = &field - grid;
+        ShadowField &old = shadow[level_index(i)];
+        if (!old.touched) {
+            old.touched = true;
+            touched.push_back(i);
+        }
+    }
+
+    /**
+     * Journal changes of the touched fields, in field order.
+     */
+    void write_journal() {
+        journal.clear();
+        std::sort(touched.begin(), touched.end());
+
+        for (int i : touched) {
+            int n = level_index(i);
+            shadow[n].touched = false;
+            journal_field(i, n);
+        }
+
+        touched.clear();
+    }
+
+    /**
+     * Journal change of grid field i, n is its index in level data.
+     */
+    void journal_field(int i, int n) {
+        const Field &field = grid[i];
+        ShadowField &old = shadow[n];
+
+        if (field.type != old.type || field.hint != old.hint || field.countdown != old.countdown) {
+            CellChange change;
+            change.cell = n;
+            change.old_type = old.type;
+            change.new_type = field.type;
+            change.countdown = field.countdown;
+            change.hint_changed = old.hint ^ field.hint;
+            change.reserved = 0;
+            journal.push_back(change);
+
+            old.type = field.type;
+            old.countdown = field.countdown;
+            old.hint = field.hint;
+        }
+    }
+
+    /**
+     * Take current fields as the base of the next journal.
+     */
+    void sync_journal() {
+        journal.clear();
+        touched.clear();
+
+        for (size_t i = 0; i < shadow.size(); ++i) {
+            const Field &fld = field(i);
+            shadow[i].type = fld.type;
+            shadow[i].countdown = fld.countdown;
+            shadow[i].hint = fld.hint;
+            shadow[i].touched = false;
+
+            // Skip of fields exploded between steps is cleared by the next step without touching them.
+            if (fld.hint & HINT_SKIP) {
+                touch(fld);
+            }
+        }
+    }
+
+    /**
+     * Timer wheel. Bucket for step N contains indexes of fields with timer due in that step (explosion phases), or
+     * TIMER_GAME_OVER. Fields can be present more than once, the state of the field decides what happens.
+     */
+    std::vector<int> timers[TIMER_WHEEL_SIZE];
+
+    /**
+     * Schedule timer delay steps from now. Delay 0 can only be used between game steps.
+     */
+    void schedule(int delay, int timer) {
+        timers[(step_no + delay) % TIMER_WHEEL_SIZE].push_back(timer);
+    }
+
+    /**
+     * Recreate timers from the state of fields, after the level has been loaded.
+     */
+    void rebuild_timers(int game_over_in) {
+        for (std::vector<int> &bucket : timers) {
+            bucket.clear();
+        }
+
+        game_over = !murphy_alive && game_over_in < 0;
+
+        if (!murphy_alive && game_over_in >= 0) {
+            schedule(game_over_in, TIMER_GAME_OVER);
+        }
+
+        for (int y = 0; y < height(); ++y) {
+            int end = grid_index(Point(width(), y));
+            for (int i = grid_index(Point(0, y)); i < end; ++i) {
+                if (grid[i].has_hint(HINT_EXPLOSION | HINT_EXPLOSION_INFOTRON)) {
+                    // Field exploded between steps will be untouched in the next step.
+                    schedule(grid[i].has_hint(HINT_SKIP) ? 1 : 0, i);
+                }
+            }
+        }
+    }
+
+    /**
+     * Fill the grid with guard fields, level fields are set by the caller.
+     */
+    void init_grid() {
+        for (int i = 0; i < GRID_SIZE; ++i) {
+            grid[i] = Field();
+            grid[i].coords = Point(i % STRIDE - 1, i / STRIDE - 1);
+            grid[i].type = FT_BORDER;
+        }
+    }
+
+    static int grid_index(Point p) {
+        return (p.y + 1) * STRIDE + p.x + 1;
+    }
+
+    /**
+     * Index in level data of grid field i.
+     */
+    static int level_index(int i) {
+        return (i / STRIDE - 1) * LEVEL_WIDTH + i % STRIDE - 1;
+    }
+
+    Field &neighbour(Field &fld, Direction dir) {
+        return (&fld)[OFFSETS[dir]];
+    }
+
+	unsigned int hint_from_direction(Direction dir) {
+		switch (dir) {
+		case DIR_NONE:
+			return HINT_NONE;
+		case DIR_LEFT:
+			return HINT_FROM_RIGHT;
+		case DIR_RIGHT:
+			return HINT_FROM_LEFT;
+		case DIR_UP:
+			return HINT_FROM_BOTTOM;
+		case DIR_DOWN:
+			return HINT_FROM_TOP;
+		}
+	}
+
+	Direction turn_left(const Direction &dir) {
+		switch (dir) {
+		case DIR_NONE:
+			return DIR_NONE;
+		case DIR_LEFT:
+			return DIR_DOWN;
+		case DIR_RIGHT:
+			return DIR_UP;
+		case DIR_UP:
+			return DIR_LEFT;
+		case DIR_DOWN:
+			return DIR_RIGHT;
+		}
+	}
+
+	Direction turn_right(const Direction &dir) {
+		switch (dir) {
+		case DIR_NONE:
+			return DIR_NONE;
+		case DIR_LEFT:
+			return DIR_UP;
+		case DIR_RIGHT:
+			return DIR_DOWN;
+		case DIR_UP:
+			return DIR_RIGHT;
+		case DIR_DOWN:
+			return DIR_LEFT;
+		}
+	}
+
+	Direction turn_back(const Direction &dir) {
+		switch (dir) {
+		case DIR_NONE:
+			return DIR_NONE;
+		case DIR_LEFT:
+			return DIR_RIGHT;
+		case DIR_RIGHT:
+			return DIR_LEFT;
+		case DIR_UP:
+			return DIR_DOWN;
+		case DIR_DOWN:
+			return DIR_UP;
+		}
+	}
+
+    void fall(Field &fld, bool destructive) {
+        Field &below = neighbour(fld, DIR_DOWN);
+
+        TRACE_FIELDS(TRACE_FALL, &fld, &below);
+
+        switch (below.type) {
+            case FT_EMPTY:
+                if (!below.has_hint(HINT_LEAVING)) {
+                    touch(fld);
+                    touch(below);
+                    below.type = fld.type;
+                    fld.type = FT_EMPTY;
+                    below.set_hint(HINT_FALL | HINT_SKIP);
+                    ++step_counters.falls;
+				}
+                break;
+
+            case FT_MURPHY:
+            case FT_SNIK_SNAK:
+            case FT_ORANGE_DISK:
+                if (fld.has_hint(HINT_FALL) && (below.type != FT_MURPHY || !below.has_hint(HINT_LEAVING))) {
+                    explode_9(below, FT_EMPTY);
+                }
+                break;
+
+            case FT_ELECTRON:
+                if (fld.has_hint(HINT_FALL)) {
+                    explode_9(below, FT_INFOTRON);
+                }
+                break;
+
+            default:
+                if (fld.has_hint(HINT_FALL) && destructive) {
+                    explode_9(fld, FT_EMPTY);
+                } else if (below.rolls_on_impact()) {
+                    Field &left = neighbour(fld, DIR_LEFT);
+                    Field &right = neighbour(fld, DIR_RIGHT);
+                    Field &lbelow = neighbour(left, DIR_DOWN);
+                    Field &rbelow = neighbour(right, DIR_DOWN);
+
+                    TRACE_FIELDS(TRACE_FALL, &left, &right);
+
+                    // Roll left
+                    if (left.type == FT_EMPTY && lbelow.type == FT_EMPTY) {
+						if (!left.has_hint(HINT_LEAVING) && !lbelow.has_hint(HINT_LEAVING)) {
+							touch(fld);
+							touch(left);
+							left.type = fld.type;
+							fld.type = FT_EMPTY;
+							left.set_hint(HINT_FROM_RIGHT | HINT_SKIP);
+							++step_counters.rolls_left;
+						}
+                    }
+
+                    // Roll right
+                    else if (right.type == FT_EMPTY && rbelow.type == FT_EMPTY) {
+						if (!right.has_hint(HINT_LEAVING) && !rbelow.has_hint(HINT_LEAVING)) {
+							touch(fld);
+							touch(right);
+							right.type = fld.type;
 							fld.type = FT_EMPTY;
 							right.set_hint(HINT_FROM_LEFT | HINT_SKIP);
+							++step_counters.rolls_right;
 						}
                     }
                 }
                 break;
         }
 
-        fld.del_hint(HINT_FALL);
-    }
+        // Most objects rest, touch only those that stop falling.
+        if (fld.has_hint(HINT_FALL)) {
+            touch(fld);
+            fld.del_hint(HINT_FALL);
+        }
+    }
+
+    void explode_9(Field &origin, FieldType fill) {
+        TRACE_AREA(TRACE_EXPLOSION, origin.coords);
+        ++step_counters.explosions;
+
+        int center = &origin - grid;
+
+        // Guard fields are not affected by explosions, so the area never leaves the grid.
+        for (int row = center - STRIDE; row <= center + STRIDE; row += STRIDE) {
+            for (int idx = row - 1; idx <= row + 1; ++idx) {
+                Field &fld = grid[idx];
+                touch(fld);
+
+                if (fld.affected_by_explosion()) {
+                    if (fill == FT_EMPTY) {
+                        fld.set_hint(HINT_EXPLOSION | HINT_SKIP);
+                        fld.countdown = EXPLOSION_STEPS;
+                        schedule(1, idx);
+                    } else if (fill == FT_INFOTRON) {
+                        fld.set_hint(HINT_EXPLOSION_INFOTRON | HINT_SKIP);
+                        fld.countdown = EXPLOSION_STEPS;
+                        schedule(1, idx);
+                    }
+                }
+
+                if (fld.type == FT_MURPHY && murphy_alive) {
+                    murphy_alive = false;
+                    schedule(end_game_timeout, TIMER_GAME_OVER);
+                }
+            }
+        }
+
+        origin.set_hint(HINT_EXPLOSION_ORIGIN);
+    }
+
+    void move_npc(Field &field, Direction dir) {
+        Direction can_turn = DIR_NONE;
+
+        if (!field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
+            // Test whether we can rotate left.
+            Field &left = neighbour(field, turn_left(dir));
+            Field &right = neighbour(field, turn_right(dir));
+
+            if (left.type == FT_EMPTY && !left.has_hint(HINT_LEAVING)) {
+                can_turn = DIR_LEFT;
+            } else if (right.type == FT_EMPTY && !right.has_hint(HINT_LEAVING)) {
+                can_turn = DIR_RIGHT;
+            }
+        }
+
+        Field &next = neighbour(field, dir);
+
+        TRACE_FIELDS(TRACE_NPC, &field, &next);
+        touch(field);
+
+        // Clear current move, because we already now what we are going to do here.
+        field.del_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT | HINT_FROM_TOP | HINT_FROM_BOTTOM | HINT_FROM_LEFT | HINT_FROM_RIGHT);
+
+        bool moving = false;
+
+        if ((can_turn == DIR_NONE || can_turn == DIR_RIGHT) && !next.has_hint(HINT_LEAVING)) {
+            touch(next);
+
+            if (next.type == FT_EMPTY) {
+                next.type = field.type;
+				next.set_hint(hint_from_direction(dir) | HINT_SKIP);
+
+                field.type = FT_EMPTY;
+                field.set_hint(HINT_LEAVING);
+
+                moving = true;
+                ++step_counters.npc_moves;
+            } else if (next.type == FT_MURPHY) {
+                explode_9(next, FT_EMPTY);
+            }
+
+            next.set_hint(HINT_SKIP);
+        }
+
+        if (!moving && can_turn == DIR_LEFT) {
+            // Rotate left.
+			field.set_hint(hint_from_direction(turn_left(dir)) | HINT_TURN_LEFT);
+        } else if (!moving) {
+            // Rotate right.
+			field.set_hint(hint_from_direction(turn_right(dir)) | HINT_TURN_RIGHT);
+        }
+
+        if (!moving) {
+            ++step_counters.npc_turns;
+        }
+    }
+};
+
+/**
+ * Binary snapshot of a running game.
+ *
+ * Layout is fixed (native byte order), so the file is used directly as mapped from the disk, without any parsing.
+ * Everything except the header is covered by the checksum.
+ */
+struct SaveState {
+    static const uint32_t MAGIC = 0x54535053; /**< "SPST" */
+    static const uint32_t VERSION = 3;
+
+    struct Cell {
+        uint8_t type;
+        uint8_t reserved[3];
+        uint32_t hint;
+        int32_t countdown;
+    };
+
+    uint32_t magic;
+    uint32_t version;
+    uint32_t size;
+    uint32_t checksum;
+
+    uint8_t gravitation;
+    uint8_t freeze_zonks;
+    uint8_t murphy_alive;
+    uint8_t special_down;
+    int32_t murphy_x;
+    int32_t murphy_y;
+    int32_t next_move;
+    int32_t end_game_timeout;
+    int32_t last_murphy_side_move; /**< Drawer state, Murphy keeps facing the side he moved to last time. */
+    int32_t animation_frame;
+    int32_t infotrons_collected;
+    uint32_t step; /**< Number of game steps done. */
+    char title[Level::LEVEL_NAME_LENGTH + 1];
+
+    Cell cells[Level::LEVEL_WIDTH * Level::LEVEL_HEIGHT];
+
+    /**
+     * Fill in header and checksum. Must be called after all other fields are set.
+     */
+    void seal() {
+        magic = MAGIC;
+        version = VERSION;
+        size = sizeof(SaveState);
+        checksum = compute_checksum();
+    }
+
+    /**
+     * Header and checksum match, and every value is in the range the engine can restore. Checksum guards only against
+     * damaged files, crafted ones must not get Murphy or the timers outside of the level.
+     */
+    bool valid() const {
+        if (magic != MAGIC || version != VERSION || size != sizeof(SaveState) || checksum != compute_checksum()) {
+            return false;
+        }
+
+        if (murphy_x < 0 || murphy_x >= Level::LEVEL_WIDTH || murphy_y < 0 || murphy_y >= Level::LEVEL_HEIGHT
+            || next_move < DIR_NONE || next_move > DIR_RIGHT
+            || last_murphy_side_move < DIR_NONE || last_murphy_side_move > DIR_RIGHT
+            || end_game_timeout < -1 || end_game_timeout >= Level::TIMER_WHEEL_SIZE || step > INT32_MAX)
+        {
+            return false;
+        }
+
+        for (const Cell &cell : cells) {
+            if (cell.type > FT_CHIP_NS_2 || cell.countdown < 0 || cell.countdown > EXPLOSION_STEPS) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    bool write(const char *file_name) const {
+#ifndef _WIN32
+        FILE *f = fopen(file_name, "wb");
+#else
+        FILE *f;
+        fopen_s(&f, file_name, "wb");
+#endif
+
+        if (!f) {
+            return false;
+        }
+
+        bool ok = fwrite(this, sizeof(SaveState), 1, f) == 1;
+        return (fclose(f) == 0) && ok;
+    }
+
+protected:
+    /**
+     * FNV-1a of everything that follows the header.
+     */
+    uint32_t compute_checksum() const {
+        const uint8_t *begin = (const uint8_t *)&gravitation;
+        const uint8_t *end = (const uint8_t *)(this + 1);
+
+        uint32_t hash = 2166136261u;
+        for (const uint8_t *p = begin; p < end; ++p) {
+            hash = (hash ^ *p) * 16777619u;
+        }
+
+        return hash;
+    }
+};
+
+static_assert(sizeof(SaveState::Cell) == 12, "SaveState::Cell must not be padded.");
+static_assert(offsetof(SaveState, cells) == 76, "SaveState layout must not be padded.");
+
+/**
+ * Save state file opened for reading. The file is memory mapped where available, otherwise read by single read.
+ */
+class SaveStateFile {
+public:
+    SaveStateFile(const char *file_name): data(nullptr) {
+#ifndef _WIN32
+        int fd = open(file_name, O_RDONLY);
+        if (fd < 0) {
+            return;
+        }
+
+        struct stat st;
+        if (fstat(fd, &st) == 0 && st.st_size == sizeof(SaveState)) {
+            void *mapped = mmap(nullptr, sizeof(SaveState), PROT_READ, MAP_PRIVATE, fd, 0);
+            if (mapped != MAP_FAILED) {
+                data = (const SaveState *)mapped;
+            }
+        }
+
+        close(fd);
+#else
+        FILE *f;
+        fopen_s(&f, file_name, "rb");
+        if (!f) {
+            return;
+        }
+
+        SaveState *buffer = new SaveState;
+        if (fread(buffer, sizeof(SaveState), 1, f) == 1 && fgetc(f) == EOF) {
+            data = buffer;
+        } else {
+            delete buffer;
+        }
+
+        fclose(f);
+#endif
+
+        if (data && !data->valid()) {
+            release();
+        }
+    }
+
+    ~SaveStateFile() {
+        release();
+    }
+
+    SaveStateFile(const SaveStateFile &) = delete;
+    SaveStateFile &operator=(const SaveStateFile &) = delete;
+
+    /**
+     * Return validated state, or nullptr when the file cannot be read, is truncated, of other version or corrupted.
+     */
+    const SaveState *state() const {
+        return data;
+    }
+
+protected:
+    const SaveState *data;
+
+    void release() {
+        if (data) {
+#ifndef _WIN32
+            munmap((void *)data, sizeof(SaveState));
+#else
+            delete data;
+#endif
+            data = nullptr;
+        }
+    }
+};
+
+constexpr int Level::OFFSETS[];
+
+Level::Level(const SaveState &state) {
+    init_grid();
+    load_state(state);
+}
+
+void Level::save_state(SaveState &state) const {
+    memset(&state, 0, sizeof(SaveState));
+
+    state.gravitation = gravitation;
+    state.freeze_zonks = freeze_zonks;
+    state.murphy_alive = murphy_alive;
+    state.special_down = special_down;
+    state.murphy_x = murphy.x;
+    state.murphy_y = murphy.y;
+    state.next_move = next_move;
+    state.infotrons_collected = infotrons_collected;
+    state.step = step_no;
+    memcpy(state.title, title, LEVEL_NAME_LENGTH);
+
+    state.end_game_timeout = end_game_timeout_left();
+
+    for (int i = 0; i < width() * height(); ++i) {
+        const Field &fld = field(i);
+        state.cells[i].type = fld.type;
+        state.cells[i].hint = fld.hint;
+        state.cells[i].countdown = fld.countdown;
+    }
+}
+
+void Level::load_state(const SaveState &state) {
+    gravitation = state.gravitation;
+    freeze_zonks = state.freeze_zonks;
+    murphy_alive = state.murphy_alive;
+    special_down = state.special_down;
+    murphy_moved = false;
+    end_game_requested = false;
+    infotrons_collected = state.infotrons_collected;
+    step_counters = SimCounters();
+    counters = SimCounters();
+    murphy = Point(state.murphy_x, state.murphy_y);
+    next_move = (Direction)state.next_move;
+    memcpy(title, state.title, LEVEL_NAME_LENGTH);
+#if CELL_TRACE
+    trace_game = CellTrace::next_game();
+#endif
+
+    for (int i = 0; i < width() * height(); ++i) {
+        Field &fld = field(i);
+        fld.type = (FieldType)state.cells[i].type;
+        fld.hint = state.cells[i].hint;
+        fld.countdown = state.cells[i].countdown;
+    }
+
+    // Timers are due relative to the step number, it must be restored first.
+    step_no = state.step;
+    rebuild_timers(state.end_game_timeout);
+    sync_journal();
+
+    if (infotron_distances.enabled()) {
+        infotron_distances.rebuild(&field(0, 0), LEVEL_WIDTH, LEVEL_HEIGHT, STRIDE, FT_INFOTRON);
+        exit_distances.rebuild(&field(0, 0), LEVEL_WIDTH, LEVEL_HEIGHT, STRIDE, FT_EXIT);
+    }
+}
+
+/**
+ * Recorded game: level number and input for every game step, in the encoding of Level::encode_input().
+ *
+ * Since version 2 the file may also carry keyframes, full game states after every keyframe_interval steps, so any
+ * step can be reached by restoring the nearest earlier keyframe (see ReplaySeeker). Version 4 keyframes use the save
+ * state version 3, which carries the step number. Inputs of older files are still read, their keyframes are dropped
+ * (--index-replay writes new ones).
+ */
+struct Replay {
+    static const uint32_t MAGIC = 0x50525053; /**< "SPRP" */
+    static const uint32_t VERSION = 4;
+
+    struct Header {
+        uint32_t magic;
+        uint32_t version;
+        int32_t level;
+        uint32_t steps;
+    };
+
+    /**
+     * Follows the header since version 2.
+     */
+    struct KeyframeHeader {
+        uint32_t interval;
+        uint32_t count;
+    };
+
+    struct Keyframe {
+        uint32_t step; /**< Number of steps done before the state has been saved. */
+        SaveState state;
+    };
+
+    int level;
+    std::vector<uint8_t> inputs;
+    uint32_t keyframe_interval; /**< Steps between keyframes, 0 for none. */
+    std::vector<Keyframe> keyframes;
+
+    Replay(): level(1), keyframe_interval(0) {}
+
+    /**
+     * Store the state of the level after all recorded inputs have been played.
+     */
+    void add_keyframe(const Level &game) {
+        keyframes.emplace_back();
+        Keyframe &keyframe = keyframes.back();
+        keyframe.step = inputs.size();
+        game.save_state(keyframe.state);
+        // Seeking restores the step count with the state, it must be the replay step.
+        keyframe.state.step = keyframe.step;
+        keyframe.state.seal();
+    }
+
+    /**
+     * Replace keyframes by new ones taken every interval steps, by playing the whole replay.
+     */
+    void build_keyframes(const char *levels_file, uint32_t interval) {
+        keyframe_interval = interval;
+        keyframes.clear();
+
+        if (interval == 0) {
+            return;
+        }
+
+        Level game(levels_file, level);
+        std::vector<uint8_t> all;
+        all.swap(inputs);
+
+        for (uint8_t input : all) {
+            dispatch_input(&game, input);
+            game.game_step();
+            inputs.push_back(input);
+
+            if (inputs.size() % interval == 0) {
+                add_keyframe(game);
+            }
+        }
+    }
+
+    /**
+     * Size of the file written by write().
+     */
+    size_t file_size() const {
+        return sizeof(Header) + sizeof(KeyframeHeader) + inputs.size() + keyframes.size() * sizeof(Keyframe);
+    }
+
+    bool write(const char *file_name) const {
+        FILE *f = fopen(file_name, "wb");
+        if (!f) {
+            return false;
+        }
+
+        Header header = { MAGIC, VERSION, level, (uint32_t)inputs.size() };
+        KeyframeHeader keyframe_header = { keyframe_interval, (uint32_t)keyframes.size() };
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1
+            && fwrite(&keyframe_header, sizeof(keyframe_header), 1, f) == 1
+            && fwrite(inputs.data(), 1, inputs.size(), f) == inputs.size()
+            && fwrite(keyframes.data(), sizeof(Keyframe), keyframes.size(), f) == keyframes.size();
+
+        return (fclose(f) == 0) && ok;
+    }
+
+    /**
+     * Read the replay of a level from levels_file. Fails when the level is not in levels_file or the counts in the
+     * headers do not fit the file.
+     */
+    bool read(const char *file_name, const char *levels_file) {
+        FILE *f = fopen(file_name, "rb");
+        if (!f) {
+            return false;
+        }
+
+        fseek(f, 0, SEEK_END);
+        long size = ftell(f);
+        fseek(f, 0, SEEK_SET);
+
+        Header header;
+        KeyframeHeader keyframe_header = { 0, 0 };
+        bool ok = fread(&header, sizeof(header), 1, f) == 1 && header.magic == MAGIC
+            && header.version >= 1 && header.version <= VERSION;
+
+        if (ok && header.version >= 2) {
+            ok = fread(&keyframe_header, sizeof(keyframe_header), 1, f) == 1;
+        }
+
+        if (header.version < VERSION) {
+            // Keyframes hold save states of a previous version, the inputs are still good.
+            keyframe_header.interval = 0;
+            keyframe_header.count = 0;
+        }
+
+        if (ok) {
+            ok = header.level >= 1 && header.level <= Level::level_count(levels_file);
+        }
+
+        if (ok) {
+            // Check the counts against the file before allocating for them, a damaged header could ask for gigabytes.
+            uint64_t remaining = size - ftell(f);
+            ok = header.steps + (uint64_t)keyframe_header.count * sizeof(Keyframe) <= remaining;
+        }
+
+        if (ok) {
+            level = header.level;
+            inputs.resize(header.steps);
+            keyframe_interval = keyframe_header.interval;
+            keyframes.resize(keyframe_header.count);
+
+            ok = fread(inputs.data(), 1, inputs.size(), f) == inputs.size()
+                && fread(keyframes.data(), sizeof(Keyframe), keyframes.size(), f) == keyframes.size();
+        }
+
+        for (size_t i = 0; ok && i < keyframes.size(); ++i) {
+            ok = keyframes[i].state.valid() && keyframes[i].state.step == keyframes[i].step
+                && keyframes[i].step <= inputs.size()
+                && (i == 0 || keyframes[i].step > keyframes[i - 1].step);
+        }
+
+        fclose(f);
+        return ok;
+    }
+};
+
+/**
+ * Detects that a game played without input has entered a cycle, like NPCs patrolling fixed loops around idle
+ * Murphy. Fingerprint of the level costs about as much as a game step, so it is taken only every SAMPLE steps and
+ * compared with a checkpoint (Brent's cycle detection on the sampled states). Recent fingerprints are kept to find
+ * where the cycle started.
+ *
+ * Sampled states repeat after the least common multiple of the cycle and SAMPLE, which is reported as the period.
+ * It is a whole number of cycles, the caller can find the shortest one while confirming it.
+ *
+ * Fingerprints only cover the fields. Without input and pending timers (explosions change fields in every step, game
+ * over needs dead Murphy) the fields decide all following steps. Equal fingerprints can still collide, so the caller
+ * should confirm the period before relying on it.
+ */
+class CycleDetector {
+public:
+    static const int SAMPLE = 16;    /**< Steps between fingerprints. */
+    static const int HISTORY = 4096; /**< Recent fingerprints kept for finding the start of the cycle. */
+
+    /**
+     * Start detection from the current state.
+     */
+    explicit CycleDetector(const Level &level) {
+        reset(level);
+    }
+
+    void reset(const Level &level) {
+        samples = 0;
+        steps = 0;
+        history[0] = level.fingerprint();
+        checkpoint = history[0];
+        checkpoint_sample = 0;
+        power = 1;
+        found_period = 0;
+        found_start = 0;
+    }
+
+    /**
+     * Called after every game step done without input. Return true when the state repeats, then period() and start()
+     * describe the cycle.
+     */
+    bool step(const Level &level) {
+        if (++steps % SAMPLE != 0) {
+            return false;
+        }
+
+        if (!level.murphy_alive) {
+            // Game over is pending, it is not in the fields.
+            return false;
+        }
+
+        uint64_t hash = level.fingerprint();
+
+        ++samples;
+        history[samples % HISTORY] = hash;
+
+        if (hash == checkpoint) {
+            long period = samples - checkpoint_sample;
+
+            // Walk back while the fingerprints one period apart are still equal.
+            long start = checkpoint_sample;
+            long oldest = std::max(0L, samples - HISTORY + 1);
+            while (start > oldest && fingerprint(start - 1) == fingerprint(start - 1 + period)) {
+                --start;
+            }
+
+            found_period = period * SAMPLE;
+            found_start = start * SAMPLE;
+            return true;
+        }
+
+        if (samples - checkpoint_sample == power) {
+            checkpoint = hash;
+            checkpoint_sample = samples;
+            power *= 2;
+        }
+
+        return false;
+    }
+
+    /**
+     * Steps between repeating states, a multiple of the shortest cycle.
+     */
+    long period() const {
+        return found_period;
+    }
+
+    /**
+     * First step of the cycle, counted from the reset, to within SAMPLE steps. Exact to the sample when the cycle
+     * started within HISTORY samples of its detection, otherwise the oldest sample known to be in the cycle.
+     */
+    long start() const {
+        return found_start;
+    }
+
+    long steps_done() const {
+        return steps;
+    }
+
+protected:
+    long steps;
+    long samples;
+    uint64_t history[HISTORY];
+    uint64_t checkpoint;    /**< Fingerprint every later one is compared with. */
+    long checkpoint_sample;
+    long power;             /**< Samples until the checkpoint moves, doubles every time. */
+    long found_period;
+    long found_start;
+
+    uint64_t fingerprint(long sample) const {
+        return history[sample % HISTORY];
+    }
+};
+
+/**
+ * Random access to the game states of a replay. Seeking restores the nearest keyframe at or before the step and
+ * simulates only the steps after it, or continues from the current state when that is closer.
+ */
+class ReplaySeeker {
+public:
+    ReplaySeeker(const char *levels_file, const Replay &replay): replay(replay), game(levels_file, replay.level),
+        position(0), simulated(0)
+    {
+        game.save_state(start);
+    }
+
+    /**
+     * Game after given number of replay steps (at most the length of the replay).
+     */
+    const Level &seek(uint32_t step) {
+        step = std::min(step, (uint32_t)replay.inputs.size());
+
+        // Last keyframe at or before the step.
+        auto next = std::upper_bound(replay.keyframes.begin(), replay.keyframes.end(), step,
+            [](uint32_t s, const Replay::Keyframe &keyframe) { return s < keyframe.step; });
+        uint32_t base = next == replay.keyframes.begin() ? 0 : (next - 1)->step;
+
+        if (position > step || position < base) {
+            if (next == replay.keyframes.begin()) {
+                game.load_state(start);
+            } else {
+                game.load_state((next - 1)->state);
+            }
+
+            position = base;
+        }
+
+        simulated = 0;
+        for (; position < step; ++position, ++simulated) {
+            dispatch_input(&game, replay.inputs[position]);
+            game.game_step();
+        }
+
+        return game;
+    }
+
+    /**
+     * Number of steps simulated by the last seek.
+     */
+    uint32_t steps_simulated() const {
+        return simulated;
+    }
+
+protected:
+    const Replay &replay;
+    Level game;
+    SaveState start;   /**< Level as loaded, for steps before the first keyframe. */
+    uint32_t position; /**< Number of replay steps the game is after. */
+    uint32_t simulated;
+};
+
+/**
+ * Frozen copy of the original game step, used as the oracle when checking Level in lockstep.
+ *
+ * Do not optimise or fix anything here. Behavioural changes of the game must be done in Level, and copied here only
+ * once they are verified to be intended.
+ */
+class ReferenceLevel {
+public:
+    static const int LEVEL_WIDTH = Level::LEVEL_WIDTH;
+    static const int LEVEL_HEIGHT = Level::LEVEL_HEIGHT;
+
+    Field data[LEVEL_WIDTH * LEVEL_HEIGHT];
+    bool gravitation, freeze_zonks;
+
+    bool murphy_alive;
+    bool special_down;
+
+    int end_game_timeout = 8;
+
+public:
+    ReferenceLevel(const SaveState &state) {
+        load_state(state);
+    }
+
+    void load_state(const SaveState &state) {
+        gravitation = state.gravitation;
+        freeze_zonks = state.freeze_zonks;
+        murphy_alive = state.murphy_alive;
+        special_down = state.special_down;
+        murphy = Point(state.murphy_x, state.murphy_y);
+        next_move = (Direction)state.next_move;
+        end_game_timeout = state.end_game_timeout;
+
+        for (int i = 0; i < width() * height(); ++i) {
+            data[i].coords = Point(i % width(), i / width());
+            data[i].type = (FieldType)state.cells[i].type;
+            data[i].hint = state.cells[i].hint;
+            data[i].countdown = state.cells[i].countdown;
+        }
+    }
+
+    Point murphy_position() const {
+        return murphy;
+    }
+
+    bool game_step() {
+
+
+        if (next_move != DIR_NONE && murphy_alive) {
+            Point next = next_point(murphy, next_move);
+            Field &fld = data[data_idx(next)];
+			Field &murphy_fld = data[data_idx(murphy)];
+
+            bool allow_move = false;
+
+			murphy_fld.del_hint(HINT_PUSH);
+
+            switch (fld.type) {
+                case FT_BASE:
+                    fld.set_hint(HINT_WAS_BASE);
+                case FT_EMPTY:
+					// Explode murphy if there is something leaving the field... but only if it is not murphy itself.
+                    if (fld.has_hint(HINT_LEAVING) && !(murphy_fld.has_hint(hint_from_direction(turn_back(next_move))))
+                            && !special_down)
+                    {
+                        explode_9(fld, FT_BASE);
+                    } else {
+                        allow_move = true;
+                    }
+                    break;
+
+                case FT_INFOTRON:
+                    // TODO: Eat infotron
+                    fld.set_hint(HINT_WAS_INFOTRON);
+                    allow_move = true;
+                    break;
+
+                case FT_RED_DISK:
+                    // TODO: Increment disks
+                    fld.set_hint(HINT_WAS_RED_DISK);
+                    allow_move = true;
+                    break;
+
+				case FT_ZONK:
+				case FT_ORANGE_DISK:
+				case FT_YELLOW_DISK:
+                    if (special_down) {
+                        break;
+                    }
+
+					// Crash to falling objects.
+					if (fld.has_hint(HINT_FALL)) {
+						explode_9(fld, FT_BASE);
+
+					// Allow pushing only to left or right, and yellow disk in any direction.
+					} else if (fld.type == FT_YELLOW_DISK || next_move == DIR_LEFT || next_move == DIR_RIGHT) {
+						Point more = next_point(next, next_move);
+						Field &fld_more = data[data_idx(more)];
+
+						if (fld_more.type == FT_EMPTY && !fld_more.has_hint(HINT_LEAVING)) {
+							murphy_fld.set_hint(HINT_PUSH);
+							if (murphy_fld.countdown == 1) {
+								fld_more.type = fld.type;
+								fld_more.set_hint(hint_from_direction(next_move) | HINT_SKIP);
+								allow_move = true;
+								murphy_fld.countdown = 0;
+							}
+							else {
+								murphy_fld.countdown = 1;
+							}
+						}
+					}
+					break;
+
+                default:
+                    allow_move = false;
+                    break;
+            }
+
+			// Reset countdown used for push.
+			if (!murphy_fld.has_hint(HINT_PUSH)) {
+				murphy_fld.countdown = 0;
+			}
+
+            if (allow_move) {
+                Field &origin = data[data_idx(murphy)];
+                if (!special_down) {
+                    origin.type = FT_EMPTY;
+                    origin.set_hint(HINT_LEAVING | HINT_SKIP);
+                    origin.del_hint(HINT_FROM_BOTTOM | HINT_FROM_TOP | HINT_FROM_RIGHT | HINT_FROM_LEFT | HINT_WAS_INFOTRON | HINT_WAS_BASE | HINT_WAS_RED_DISK);
+
+                    fld.type = FT_MURPHY;
+    				fld.set_hint(hint_from_direction(next_move) | HINT_SKIP);
+
+    				if (origin.has_hint(HINT_PUSH)) {
+    					fld.set_hint(HINT_PUSH);
+    					origin.del_hint(HINT_PUSH);
+    				}
+
+                    murphy = next;
+                } else {
+                    fld.type = FT_EMPTY;
+                    fld.set_hint(HINT_SKIP | HINT_LEAVING);
+                }
+            }
+        }
+        next_move = DIR_NONE;
+
+		for (int i = 0; i < width() * height(); ++i) {
+			Field &field = data[i];
+			if (field.has_hint(HINT_SKIP)) {
+				continue;
+			}
+
+			if (field.has_hint(HINT_LEAVING)) {
+    		    field.del_hint(HINT_LEAVING | HINT_WAS_BASE | HINT_WAS_INFOTRON | HINT_WAS_RED_DISK);
+			}
+		}
+
+        // Do NPC actions
+        for (int i = 0; i < width() * height(); ++i) {
+            Field &field = data[i];
+            if (field.has_hint(HINT_SKIP)) {
+                continue;
+            }
+
+            // NPC direction must be determined here.
+            Direction dir = DIR_UP;
+            if (field.has_hint(HINT_FROM_BOTTOM)) {
+                dir = DIR_UP;
+            } else if (field.has_hint(HINT_FROM_TOP)) {
+                dir = DIR_DOWN;
+            } else if (field.has_hint(HINT_FROM_LEFT)) {
+                dir = DIR_RIGHT;
+            } else if (field.has_hint(HINT_FROM_RIGHT)) {
+                dir = DIR_LEFT;
+            }
+
+            // Remove hints from Murphy's movement.
+            if (field.type != FT_SNIK_SNAK && field.type != FT_ELECTRON) {
+                field.del_hint(HINT_FROM_BOTTOM | HINT_FROM_TOP | HINT_FROM_RIGHT | HINT_FROM_LEFT);
+            }
+
+            field.del_hint(HINT_WAS_BASE | HINT_WAS_INFOTRON | HINT_WAS_RED_DISK);
+
+            if (field.has_hint(HINT_EXPLOSION) || field.has_hint(HINT_EXPLOSION_INFOTRON)) {
+                if (field.countdown > 0) {
+                    if (field.countdown == EXPLOSION_STEPS && !field.has_hint(HINT_EXPLOSION_ORIGIN)) {
+                        // Test whether we don't need to cascade explode.
+                        if (field.explodes()) {
+                            explode_9(field, field.explodes_into());
+                        }
+                    }
+
+                    field.countdown -= 1;
+					field.set_hint(HINT_SKIP);
+                } else {
+                    if (field.has_hint(HINT_EXPLOSION)) {
+                        field.type = FT_EMPTY;
+                        field.del_hint(HINT_EXPLOSION);
+                    } else if (field.has_hint(HINT_EXPLOSION_INFOTRON)) {
+                        field.type = FT_INFOTRON;
+                        field.del_hint(HINT_EXPLOSION_INFOTRON);
+                    }
+
+                    field.del_hint(HINT_EXPLOSION_ORIGIN);
+                }
+            }
+
+			if (!field.has_hint(HINT_SKIP)) {
+				switch (field.type) {
+				case FT_ZONK:
+				case FT_INFOTRON:
+					fall(field, false);
+					break;
+
+				case FT_ORANGE_DISK:
+					fall(field, true);
+					break;
+
+				case FT_SNIK_SNAK:
+				case FT_ELECTRON:
+					move_npc(field, dir);
+					break;
+
+				default:
+					break;
+				}
+			}
+        }
+
+        // Skip is used only for current game step. Clear it for next one.
+        for (int i = 0; i < width() * height(); ++i) {
+            Field &field = data[i];
+            field.del_hint(HINT_SKIP);
+        }
+
+        return murphy_alive || (end_game_timeout-- > 0);
+    }
+
+    void dispatch_event(GameEvent event) {
+        // Do not accept new events if murphy is not alive.
+        if (!murphy_alive) {
+            return;
+        }
+
+        switch (event) {
+            case EVENT_MOVE_UP:
+                next_move = DIR_UP;
+                break;
+
+            case EVENT_MOVE_DOWN:
+                next_move = DIR_DOWN;
+                break;
+
+            case EVENT_MOVE_LEFT:
+                next_move = DIR_LEFT;
+                break;
+
+            case EVENT_MOVE_RIGHT:
+                next_move = DIR_RIGHT;
+                break;
+
+            case EVENT_MOVE_NONE:
+                next_move = DIR_NONE;
+                break;
+
+            case EVENT_END_GAME:
+                explode_9(data[data_idx(murphy)], FT_EMPTY);
+                break;
+
+            case EVENT_BTN_SPECIAL_DOWN:
+                special_down = true;
+                break;
+
+            case EVENT_BTN_SPECIAL_UP:
+                special_down = false;
+                break;
+        }
+    }
+
+    int width() const {
+        return LEVEL_WIDTH;
+    }
+
+    int height() const {
+        return LEVEL_HEIGHT;
+    }
+
+protected:
+    Direction next_move;
+    Point murphy;
+
+    Point next_point(Point current, Direction dir) const {
+        switch (dir) {
+            case DIR_UP:
+                if (current.y > 0) {
+                    return Point(current.x, current.y - 1);
+                } else {
+                    return current;
+                }
+                break;
+
+            case DIR_DOWN:
+                if (current.y < height() - 1) {
+                    return Point(current.x, current.y + 1);
+                } else {
+                    return current;
+                }
+                break;
+
+            case DIR_LEFT:
+                if (current.x > 0) {
+                    return Point(current.x - 1, current.y);
+                } else {
+                    return current;
+                }
+                break;
+
+            case DIR_RIGHT:
+                if (current.x < width() - 1) {
+                    return Point(current.x + 1, current.y);
+                } else {
+                    return current;
+                }
+                break;
+
+            default:
+                break;
+        }
+
+        return current;
+    }
+
+    int data_idx(Point p) const {
+        return p.y * width() + p.x;
+    }
+
+	unsigned int hint_from_direction(Direction dir) {
+		switch (dir) {
+		case DIR_NONE:
+			return HINT_NONE;
+		case DIR_LEFT:
+			return HINT_FROM_RIGHT;
+		case DIR_RIGHT:
+			return HINT_FROM_LEFT;
+		case DIR_UP:
+			return HINT_FROM_BOTTOM;
+		case DIR_DOWN:
+			return HINT_FROM_TOP;
+		}
+	}
+
+	Direction turn_left(const Direction &dir) {
+		switch (dir) {
+		case DIR_NONE:
+			return DIR_NONE;
+		case DIR_LEFT:
+			return DIR_DOWN;
+		case DIR_RIGHT:
+			return DIR_UP;
+		case DIR_UP:
+			return DIR_LEFT;
+		case DIR_DOWN:
+			return DIR_RIGHT;
+		}
+	}
+
+	Direction turn_right(const Direction &dir) {
+		switch (dir) {
+		case DIR_NONE:
+			return DIR_NONE;
+		case DIR_LEFT:
+			return DIR_UP;
+		case DIR_RIGHT:
+			return DIR_DOWN;
+		case DIR_UP:
+			return DIR_RIGHT;
+		case DIR_DOWN:
+			return DIR_LEFT;
+		}
+	}
+
+	Direction turn_back(const Direction &dir) {
+		switch (dir) {
+		case DIR_NONE:
+			return DIR_NONE;
+		case DIR_LEFT:
+			return DIR_RIGHT;
+		case DIR_RIGHT:
+			return DIR_LEFT;
+		case DIR_UP:
+			return DIR_DOWN;
+		case DIR_DOWN:
+			return DIR_UP;
+		}
+	}
+
+    void fall(Field &fld, bool destructive) {
+        Point pt_below = next_point(fld.coords, DIR_DOWN);
+        Field &below = data[data_idx(pt_below)];
+
+        switch (below.type) {
+            case FT_EMPTY:
+                if (!below.has_hint(HINT_LEAVING)) {
+                    below.type = fld.type;
+                    fld.type = FT_EMPTY;
+                    below.set_hint(HINT_FALL | HINT_SKIP);
+				}
+                break;
+
+            case FT_MURPHY:
+            case FT_SNIK_SNAK:
+            case FT_ORANGE_DISK:
+                if (fld.has_hint(HINT_FALL) && (below.type != FT_MURPHY || !below.has_hint(HINT_LEAVING))) {
+                    explode_9(below, FT_EMPTY);
+                }
+                break;
+
+            case FT_ELECTRON:
+                if (fld.has_hint(HINT_FALL)) {
+                    explode_9(below, FT_INFOTRON);
+                }
+                break;
+
+            default:
+                if (fld.has_hint(HINT_FALL) && destructive) {
+                    explode_9(fld, FT_EMPTY);
+                } else if (below.rolls_on_impact()) {
+                    Field &left = data[data_idx(next_point(fld.coords, DIR_LEFT))];
+                    Field &right = data[data_idx(next_point(fld.coords, DIR_RIGHT))];
+                    Field &lbelow = data[data_idx(next_point(left.coords, DIR_DOWN))];
+                    Field &rbelow = data[data_idx(next_point(right.coords, DIR_DOWN))];
+
+                    // Roll left
+                    if (left.type == FT_EMPTY && lbelow.type == FT_EMPTY) {
+						if (!left.has_hint(HINT_LEAVING) && !lbelow.has_hint(HINT_LEAVING)) {
+							left.type = fld.type;
+							fld.type = FT_EMPTY;
+							left.set_hint(HINT_FROM_RIGHT | HINT_SKIP);
+						}
+                    }
+
+                    // Roll right
+                    else if (right.type == FT_EMPTY && rbelow.type == FT_EMPTY) {
+						if (!right.has_hint(HINT_LEAVING) && !rbelow.has_hint(HINT_LEAVING)) {
+							right.type = fld.type;
+							fld.type = FT_EMPTY;
+							right.set_hint(HINT_FROM_LEFT | HINT_SKIP);
+						}
+                    }
+                }
+                break;
+        }
+
+        fld.del_hint(HINT_FALL);
+    }
+
+    void explode_9(Field &origin, FieldType fill) {
+        for (int y = origin.coords.y - 1; y <= origin.coords.y + 1; ++y) {
+            for (int x = origin.coords.x - 1; x <= origin.coords.x + 1; ++x) {
+                Field &fld = data[data_idx(Point(x, y))];
+                if (fld.affected_by_explosion()) {
+                    if (fill == FT_EMPTY) {
+                        fld.set_hint(HINT_EXPLOSION | HINT_SKIP);
+                        fld.countdown = EXPLOSION_STEPS;
+                    } else if (fill == FT_INFOTRON) {
+                        fld.set_hint(HINT_EXPLOSION_INFOTRON | HINT_SKIP);
+                        fld.countdown = EXPLOSION_STEPS;
+                    }
+                }
+
+                if (fld.type == FT_MURPHY) {
+                    murphy_alive = false;
+                }
+            }
+        }
+
+        origin.set_hint(HINT_EXPLOSION_ORIGIN);
+    }
+
+    void move_npc(Field &field, Direction dir) {
+        // Test whether we can rotate left.
+        Point turn_left_pt;
+        Point turn_right_pt;
+
+        switch (dir) {
+            case DIR_UP:
+                turn_left_pt = next_point(field.coords, DIR_LEFT);
+                turn_right_pt = next_point(field.coords, DIR_RIGHT);
+                break;
+
+            case DIR_DOWN:
+                turn_left_pt = next_point(field.coords, DIR_RIGHT);
+                turn_right_pt = next_point(field.coords, DIR_LEFT);
+                break;
+
+            case DIR_LEFT:
+                turn_left_pt = next_point(field.coords, DIR_DOWN);
+                turn_right_pt = next_point(field.coords, DIR_UP);
+                break;
+
+            case DIR_RIGHT:
+                turn_left_pt = next_point(field.coords, DIR_UP);
+                turn_right_pt = next_point(field.coords, DIR_DOWN);
+                break;
+
+            default:
+                break;
+        }
+
+        Direction can_turn = DIR_NONE;
+
+        if (!field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
+            Field &turn_left = data[data_idx(turn_left_pt)];
+            Field &turn_right = data[data_idx(turn_right_pt)];
+
+            if (turn_left.type == FT_EMPTY && !turn_left.has_hint(HINT_LEAVING)) {
+                can_turn = DIR_LEFT;
+            } else if (turn_right.type == FT_EMPTY && !turn_right.has_hint(HINT_LEAVING)) {
+                can_turn = DIR_RIGHT;
+            }
+        }
+
+        // Clear current move, because we already now what we are going to do here.
+        field.del_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT | HINT_FROM_TOP | HINT_FROM_BOTTOM | HINT_FROM_LEFT | HINT_FROM_RIGHT);
+
+        Point next_pt = next_point(field.coords, dir);
+        Field &next = data[data_idx(next_pt)];
+
+        bool moving = false;
+
+        if ((can_turn == DIR_NONE || can_turn == DIR_RIGHT) && !next.has_hint(HINT_LEAVING)) {
+            if (next.type == FT_EMPTY) {
+                next.type = field.type;
+				next.set_hint(hint_from_direction(dir) | HINT_SKIP);
+
+                field.type = FT_EMPTY;
+                field.set_hint(HINT_LEAVING);
+
+                moving = true;
+            } else if (next.type == FT_MURPHY) {
+                explode_9(next, FT_EMPTY);
+            }
+
+            next.set_hint(HINT_SKIP);
+        }
+
+        if (!moving && can_turn == DIR_LEFT) {
+            // Rotate left.
+			field.set_hint(hint_from_direction(turn_left(dir)) | HINT_TURN_LEFT);
+        } else if (!moving) {
+            // Rotate right.
+			field.set_hint(hint_from_direction(turn_right(dir)) | HINT_TURN_RIGHT);
+        }
+    }
+};
+
+/**
+ * Steps Level and ReferenceLevel in lockstep and compares their complete state after every step.
+ */
+class LockstepChecker {
+public:
+    static const int MAX_GAME_STEPS = 1000;
+
+    LockstepChecker(const char *levels_file): steps(0), games(0) {
+        int count = Level::level_count(levels_file);
+        for (int i = 1; i <= count; ++i) {
+            Level loaded(levels_file, i);
+            initial.emplace_back();
+            loaded.save_state(initial.back());
+        }
+
+        if (!initial.empty()) {
+            level = new Level(initial[0]);
+            reference = new ReferenceLevel(initial[0]);
+        } else {
+            level = nullptr;
+            reference = nullptr;
+        }
+    }
+
+    ~LockstepChecker() {
+        delete level;
+        delete reference;
+    }
+
+    LockstepChecker(const LockstepChecker &) = delete;
+    LockstepChecker &operator=(const LockstepChecker &) = delete;
+
+    int level_count() const {
+        return initial.size();
+    }
+
+    /**
+     * Play given level with the inputs. Return false on the first divergence, which is reported to out.
+     */
+    bool run(int level_no, const uint8_t *inputs, size_t count, FILE *out) {
+        level->load_state(initial[level_no - 1]);
+        reference->load_state(initial[level_no - 1]);
+        ++games;
+
+        for (size_t i = 0; i < count; ++i) {
+            dispatch_input(level, inputs[i]);
+            dispatch_input(reference, inputs[i]);
+
+            bool level_cont = level->game_step();
+            bool reference_cont = reference->game_step();
+            ++steps;
+
+            if (level_cont != reference_cont || !same_state()) {
+                report(level_no, inputs, i + 1, level_cont, reference_cont, out);
+                return false;
+            }
+
+            if (!level_cont) {
+                break;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Play all levels with random inputs until total number of steps is reached.
+     */
+    bool fuzz(long total_steps, uint64_t seed, FILE *out) {
+        uint64_t rng = seed ? seed : 1;
+
+        std::vector<uint8_t> inputs(MAX_GAME_STEPS);
+
+        for (int level_no = 1; steps < total_steps; level_no = level_no % level_count() + 1) {
+            // Hold each input for a few steps, so pushes and longer walks happen as well.
+            for (int i = 0; i < MAX_GAME_STEPS; ) {
+                uint32_t r = random_next(rng);
+                uint8_t input = (r & 7) % 5;
+                if ((r & 0xf0) == 0) {
+                    input |= INPUT_SPECIAL;
+                }
+
+                for (int hold = ((r >> 8) & 7) + 1; hold > 0 && i < MAX_GAME_STEPS; --hold) {
+                    inputs[i++] = input;
+                }
+
+                if (((r >> 12) & 0x3fff) == 0) {
+                    inputs[i - 1] |= INPUT_END_GAME;
+                }
+            }
+
+            if (!run(level_no, inputs.data(), inputs.size(), out)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    long steps;
+    long games;
+
+protected:
+    std::vector<SaveState> initial;
+    Level *level;
+    ReferenceLevel *reference;
+
+    /**
+     * Countdown has a meaning only for exploding fields, elsewhere it is a leftover.
+     */
+    static bool same_field(Field &a, Field &b) {
+        return a.type == b.type && a.hint == b.hint
+            && (!a.has_hint(HINT_EXPLOSION | HINT_EXPLOSION_INFOTRON) || a.countdown == b.countdown);
+    }
+
+    int first_different_field() {
+        for (int i = 0; i < level->width() * level->height(); ++i) {
+            if (!same_field(level->field(i), reference->data[i])) {
+                return i;
+            }
+        }
+
+        return -1;
+    }
+
+    bool same_state() {
+        Point a = level->murphy_position();
+        Point b = reference->murphy_position();
+
+        return a.x == b.x && a.y == b.y && level->murphy_alive == reference->murphy_alive
+            && level->end_game_timeout_left() == reference->end_game_timeout && first_different_field() < 0;
+    }
+
+    void report(int level_no, const uint8_t *inputs, size_t count, bool level_cont, bool reference_cont, FILE *out) {
+        fprintf(out, "Divergence in level %d at step %zu.\n", level_no, count);
+
+        int idx = first_different_field();
+        if (idx >= 0) {
+            Field fld = level->field(idx);
+            fprintf(out, "  level:     %s countdown %d\n", fld.to_string().c_str(), fld.countdown);
+            fprintf(out, "  reference: %s countdown %d\n", reference->data[idx].to_string().c_str(), reference->data[idx].countdown);
+        }
+
+        Point a = level->murphy_position();
+        Point b = reference->murphy_position();
+        fprintf(out, "  murphy:    [%dx%d] alive %d timeout %d cont %d\n", a.x, a.y, level->murphy_alive, level->end_game_timeout_left(), level_cont);
+        fprintf(out, "  reference: [%dx%d] alive %d timeout %d cont %d\n", b.x, b.y, reference->murphy_alive, reference->end_game_timeout, reference_cont);
+
+        // One character per step: direction, lower case while special is down, ! when the game was ended.
+        std::string history;
+        for (size_t i = 0; i < count; ++i) {
+            char c = ".UDLR"[(inputs[i] & INPUT_DIR_MASK) % 5];
+            if (inputs[i] & INPUT_SPECIAL) {
+                c = (c == '.') ? '_' : c - 'A' + 'a';
+            }
+
+            history += c;
+            if (inputs[i] & INPUT_END_GAME) {
+                history += '!';
+            }
+        }
+
+        fprintf(out, "  inputs:    %s\n", history.c_str());
+
+        Replay replay;
+        replay.level = level_no;
+        replay.inputs.assign(inputs, inputs + count);
+        if (replay.write(DIVERGENCE_FILE)) {
+            fprintf(out, "Inputs saved to %s, rerun with --check --replay %s.\n", DIVERGENCE_FILE, DIVERGENCE_FILE);
+        }
+    }
+
+    static constexpr const char *DIVERGENCE_FILE = "DIVERGENCE.RPL";
+};
+
+/**
+ * Vectorised environment for training agents: steps many levels with one call.
+ *
+ * Observations are written to contiguous arrays, all memory is allocated when the batch is created. Finished
+ * environments are reset immediately to the next level from the level pack, so observations always show a running
+ * game and done marks the step where the previous game has ended.
+ */
+class BatchEnv {
+public:
+    /**
+     * Hints exported as hint planes, one plane per hint, 0 or 1 for every field.
+     */
+    static const int HINT_PLANES = 8;
+
+    BatchEnv(const char *levels_file, int size, bool with_hints): size(size), with_hints(with_hints), next_level(0) {
+        int count = Level::level_count(levels_file);
+        for (int i = 1; i <= count; ++i) {
+            Level loaded(levels_file, i);
+            pack.emplace_back();
+            loaded.save_state(pack.back());
+        }
+
+        if (pack.empty()) {
+            this->size = 0;
+            return;
+        }
+
+        levels.reserve(size);
+        for (int i = 0; i < size; ++i) {
+            levels.emplace_back(pack[next_level]);
+            env_level.push_back(next_level);
+            next_level = (next_level + 1) % pack.size();
+        }
+
+        finished.resize(pack.size());
+
+        types.resize((size_t)size * FIELDS);
+        if (with_hints) {
+            hints.resize((size_t)size * HINT_PLANES * FIELDS);
+        }
+
+        reward.resize(size);
+        done.resize(size);
+        infotrons.resize(size);
+
+        for (int i = 0; i < size; ++i) {
+            observe(i);
+        }
+    }
+
+    /**
+     * Number of environments, 0 if the level pack cannot be read.
+     */
+    int count() const {
+        return size;
+    }
+
+    /**
+     * Do one step in every environment. actions[i] is input for environment i, encoded as in Level::encode_input().
+     */
+    void step(const uint8_t *actions) {
+        for (int i = 0; i < size; ++i) {
+            Level &level = levels[i];
+            bool was_alive = level.murphy_alive;
+
+            dispatch_input(&level, actions[i]);
+            bool cont = level.game_step();
+
+            reward[i] = level.infotrons_collected - infotrons[i];
+            if (was_alive && !level.murphy_alive) {
+                reward[i] -= 1.0f;
+            }
+
+            done[i] = !cont;
+            if (!cont) {
+                reset(i);
+            }
+
+            observe(i);
+        }
+    }
+
+    /**
+     * Start next level from the pack in given environment.
+     */
+    void reset(int env) {
+        finished[env_level[env]] += levels[env].counters;
+
+        levels[env].load_state(pack[next_level]);
+        env_level[env] = next_level;
+        next_level = (next_level + 1) % pack.size();
+    }
+
+    /**
+     * Simulation counters summed over all games of given level (1-based, as in the pack) played in this batch,
+     * including the running ones.
+     */
+    SimCounters level_counters(int level) const {
+        SimCounters sum = finished[level - 1];
+        for (int i = 0; i < size; ++i) {
+            if (env_level[i] == (size_t)level - 1) {
+                sum += levels[i].counters;
+            }
+        }
+
+        return sum;
+    }
+
+    /**
+     * Field types, uint8_t[count()][LEVEL_HEIGHT][LEVEL_WIDTH].
+     */
+    const uint8_t *observations() const {
+        return types.data();
+    }
+
+    /**
+     * Hint planes, uint8_t[count()][HINT_PLANES][LEVEL_HEIGHT][LEVEL_WIDTH], nullptr when created without hints.
+     */
+    const uint8_t *hint_observations() const {
+        return with_hints ? hints.data() : nullptr;
+    }
+
+    /**
+     * Reward of last step: +1 for each collected infotron, -1 when Murphy died.
+     */
+    const float *rewards() const {
+        return reward.data();
+    }
+
+    /**
+     * 1 when the game has ended in last step (and the environment has been reset).
+     */
+    const uint8_t *dones() const {
+        return done.data();
+    }
+
+protected:
+    static const int FIELDS = Level::LEVEL_WIDTH * Level::LEVEL_HEIGHT;
+
+    int size;
+    bool with_hints;
+    size_t next_level;
+
+    std::vector<SaveState> pack;
+    std::vector<Level> levels;
+    std::vector<size_t> env_level;     /**< Index of the level in the pack, for every environment. */
+    std::vector<SimCounters> finished; /**< Counters of finished games, for every level in the pack. */
+
+    std::vector<uint8_t> types;
+    std::vector<uint8_t> hints;
+    std::vector<float> reward;
+    std::vector<uint8_t> done;
+    std::vector<int> infotrons;
+
+    void observe(int env) {
+        Level &level = levels[env];
+        uint8_t *out = &types[(size_t)env * FIELDS];
+
+        for (int i = 0; i < FIELDS; ++i) {
+            out[i] = level.field(i).type;
+        }
+
+        if (with_hints) {
+            static const unsigned int planes[HINT_PLANES] = {
+                HINT_FALL, HINT_FROM_TOP, HINT_FROM_BOTTOM, HINT_FROM_LEFT, HINT_FROM_RIGHT,
+                HINT_EXPLOSION, HINT_EXPLOSION_INFOTRON, HINT_LEAVING
+            };
+
+            uint8_t *plane = &hints[(size_t)env * HINT_PLANES * FIELDS];
+            for (int p = 0; p < HINT_PLANES; ++p, plane += FIELDS) {
+                for (int i = 0; i < FIELDS; ++i) {
+                    plane[i] = (level.field(i).hint & planes[p]) != 0;
+                }
+            }
+        }
+
+        infotrons[env] = level.infotrons_collected;
+    }
+};
+
+/**
+ * Plays levels of the pack one after another. While the current level is played, the next one is read and decoded
+ * by a background thread, so switching to it when the game ends is a pointer swap.
+ */
+class LevelSequencer {
+public:
+    LevelSequencer(const char *file_name, int first): file_name(file_name),
+        count(std::max(1, Level::level_count(file_name))), current_no(first), level(new Level(file_name, first)),
+        next(nullptr), previous(nullptr), requested(false), quit(false)
+    {
+        worker = std::thread(&LevelSequencer::work, this);
+        request_next();
+    }
+
+    ~LevelSequencer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+
+        wake.notify_one();
+        worker.join();
+
+        delete level;
+        delete next;
+        delete previous;
+    }
+
+    LevelSequencer(const LevelSequencer &) = delete;
+    LevelSequencer &operator=(const LevelSequencer &) = delete;
+
+    Level *current() const {
+        return level;
+    }
+
+    int current_level() const {
+        return current_no;
+    }
+
+    /**
+     * Switch to the next level. Waits only if the background load has not finished yet.
+     */
+    Level *advance() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            loaded.wait(lock, [this]() { return next != nullptr; });
+
+            // Finished level is freed by the worker too.
+            previous = level;
+            level = next;
+            next = nullptr;
+            current_no = current_no % count + 1;
+        }
+
+        request_next();
+        return level;
+    }
+
+protected:
+    const char *file_name;
+    int count;
+    int current_no;
+
+    Level *level;
+    Level *next;     /**< Loaded next level, nullptr while it is being loaded. */
+    Level *previous; /**< Finished level, to be freed by the worker. */
+
+    std::thread worker;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable loaded;
+    bool requested;
+    bool quit;
+
+    void request_next() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requested = true;
+        }
+
+        wake.notify_one();
+    }
+
+    void work() {
+        std::unique_lock<std::mutex> lock(mutex);
+
+        while (true) {
+            wake.wait(lock, [this]() { return requested || quit; });
+            if (quit) {
+                return;
+            }
+
+            requested = false;
+            Level *finished = previous;
+            previous = nullptr;
+            int level_no = current_no % count + 1;
+
+            lock.unlock();
+            delete finished;
+            Level *loaded_level = new Level(file_name, level_no);
+            lock.lock();
+
+            next = loaded_level;
+            loaded.notify_one();
+        }
+    }
+};
+
+/**
+ * Traces single key press from the moment SDL registered it, until the frame that shows Murphy's movement is presented.
+ * Each key press gets its id, timestamps are collected for every stage it passes through.
+ */
+class LatencyTracer {
+public:
+    enum Stage {
+        STAGE_EVENT,    /**< Timestamp of the SDL event. */
+        STAGE_INPUT,    /**< Event was picked up by handle_input(). */
+        STAGE_DISPATCH, /**< dispatch_event() has set next_move. */
+        STAGE_STEP,     /**< game_step() has applied the move. */
+        STAGE_DRAW,     /**< draw() has rendered the frame with the move. */
+        STAGE_PRESENT,  /**< SDL_UpdateWindowSurface() has returned. */
+        STAGE_COUNT
+    };
+
+    struct Sample {
+        int id;
+        int64_t ts[STAGE_COUNT]; /**< Microseconds since the tracer was created. */
+    };
+
+    LatencyTracer(): start(std::chrono::steady_clock::now()), next_id(1), dropped(0) {
+        pending.id = 0;
+    }
+
+    /**
+     * New input event arrived. sdl_timestamp is SDL event timestamp, in SDL_GetTicks() time base.
+     */
+    void input(uint32_t sdl_timestamp, uint32_t sdl_now) {
+        if (pending.id > 0) {
+            // Previous input did not make it to the screen (Murphy was blocked), it is superseded by this one.
+            ++dropped;
+        }
+
+        pending.id = next_id++;
+        pending.ts[STAGE_INPUT] = now();
+        pending.ts[STAGE_EVENT] = pending.ts[STAGE_INPUT] - (int64_t)(sdl_now - sdl_timestamp) * 1000;
+        pending_stage = STAGE_DISPATCH;
+    }
+
+    /**
+     * Pending input has reached given stage. Stages that comes out of order are ignored.
+     */
+    void mark(Stage stage) {
+        if (pending.id == 0 || stage != pending_stage) {
+            return;
+        }
+
+        pending.ts[stage] = now();
+
+        if (stage == STAGE_PRESENT) {
+            samples.push_back(pending);
+            pending.id = 0;
+        } else {
+            pending_stage = (Stage)(stage + 1);
+        }
+    }
+
+    /**
+     * Game step has been done, murphy_moved tells whether the input has been applied.
+     */
+    void step(bool murphy_moved) {
+        // Blocked move (or push that needs more steps) does not finish the stage, keep waiting for the movement.
+        if (murphy_moved) {
+            mark(STAGE_STEP);
+        }
+    }
+
+    void report(FILE *out) const {
+        fprintf(out, "Input latency: %zu samples, %d inputs without movement.\n", samples.size(), dropped);
+        if (samples.empty()) {
+            return;
+        }
+
+        fprintf(out, "%-18s %9s %9s %9s %9s %9s %9s\n", "stage [ms]", "min", "mean", "p50", "p90", "p99", "max");
+
+        for (int stage = STAGE_INPUT; stage <= STAGE_COUNT; ++stage) {
+            std::vector<int64_t> values;
+            values.reserve(samples.size());
+
+            int from = (stage == STAGE_COUNT) ? STAGE_EVENT : stage - 1;
+            int to = (stage == STAGE_COUNT) ? STAGE_PRESENT : stage;
+
+            int64_t sum = 0;
+            for (const Sample &sample : samples) {
+                values.push_back(sample.ts[to] - sample.ts[from]);
+                sum += values.back();
+            }
+
+            std::sort(values.begin(), values.end());
+
+            auto percentile = [&](int p) {
+                return values[(values.size() - 1) * p / 100] / 1000.0;
+            };
+
+            fprintf(out, "%-18s %9.3f %9.3f %9.3f %9.3f %9.3f %9.3f\n",
+                (stage == STAGE_COUNT) ? "total" : stage_name(stage),
+                values.front() / 1000.0, sum / 1000.0 / values.size(),
+                percentile(50), percentile(90), percentile(99), values.back() / 1000.0);
+        }
+    }
+
+    /**
+     * Write samples in Chrome trace event format (chrome://tracing, Perfetto).
+     */
+    bool write_chrome_trace(const char *file_name) const {
+        FILE *f = fopen(file_name, "w");
+        if (!f) {
+            return false;
+        }
+
+        fprintf(f, "{\"traceEvents\":[\n");
+
+        bool first = true;
+        for (const Sample &sample : samples) {
+            for (int stage = STAGE_INPUT; stage < STAGE_COUNT; ++stage) {
+                fprintf(f, "%s{\"name\":\"%s\",\"cat\":\"input\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%lld,\"dur\":%lld,\"args\":{\"id\":%d}}",
+                    first ? "" : ",\n", stage_name(stage), sample.id % 8 + 1,
+                    (long long)sample.ts[stage - 1], (long long)(sample.ts[stage] - sample.ts[stage - 1]), sample.id);
+                first = false;
+            }
+        }
+
+        fprintf(f, "\n],\"displayTimeUnit\":\"ms\"}\n");
+        fclose(f);
+
+        return true;
+    }
+
+protected:
+    std::chrono::steady_clock::time_point start;
+    std::vector<Sample> samples;
+    Sample pending;
+    Stage pending_stage;
+    int next_id;
+    int dropped;
+
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    static const char *stage_name(int stage) {
+        // Name of the interval that ends at given stage.
+        switch (stage) {
+            case STAGE_INPUT:    return "event->input";
+            case STAGE_DISPATCH: return "input->dispatch";
+            case STAGE_STEP:     return "dispatch->step";
+            case STAGE_DRAW:     return "step->draw";
+            case STAGE_PRESENT:  return "draw->present";
+            default:             return "event";
+        }
+    }
+};
+
+/**
+ * Counts cycles, instructions, cache misses and branch misses with perf_event_open, split into the phases of a frame
+ * and aggregated per level. Reading the counters is one system call, so phases are marked only a few times per frame.
+ * Where the counters cannot be opened (other systems, containers, perf_event_paranoid) only time is reported.
+ */
+class PerfProfiler {
+public:
+    enum Phase {
+        PHASE_INPUT,   /**< handle_input() */
+        PHASE_STEP,    /**< game_step() */
+        PHASE_DRAW,    /**< draw() up to presenting the frame */
+        PHASE_PRESENT, /**< SDL_UpdateWindowSurface(), terminal output */
+        PHASE_COUNT,
+        PHASE_NONE = PHASE_COUNT
+    };
+
+    enum Counter {
+        COUNTER_CYCLES,
+        COUNTER_INSTRUCTIONS,
+        COUNTER_CACHE_MISSES,
+        COUNTER_BRANCH_MISSES,
+        COUNTER_COUNT
+    };
+
+    struct Totals {
+        uint64_t calls;
+        uint64_t ns;
+        uint64_t values[COUNTER_COUNT];
+    };
+
+    struct Row {
+        int level_no;
+        std::string title;
+        Totals phases[PHASE_COUNT];
+    };
+
+    PerfProfiler(): group(-1), opened(0), current(PHASE_NONE), row(-1) {
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            slot[c] = -1;
+        }
+
+#ifdef __linux__
+        static const uint64_t configs[COUNTER_COUNT] = {
+            PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_CACHE_MISSES,
+            PERF_COUNT_HW_BRANCH_MISSES
+        };
+
+        // One group is scheduled on the PMU at once, so the counters of a phase come from the same instructions.
+        // Counters the CPU does not have are left out of the group.
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            perf_event_attr attr;
+            memset(&attr, 0, sizeof(attr));
+            attr.size = sizeof(attr);
+            attr.type = PERF_TYPE_HARDWARE;
+            attr.config = configs[c];
+            attr.read_format = PERF_FORMAT_GROUP;
+            attr.exclude_kernel = 1;
+            attr.exclude_hv = 1;
+            attr.disabled = group < 0;
+
+            int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, group, 0);
+            if (fd < 0) {
+                error = strerror(errno);
+                continue;
+            }
+
+            if (group < 0) {
+                group = fd;
+            } else {
+                fds.push_back(fd);
+            }
+
+            slot[c] = opened++;
+        }
+
+        if (group >= 0) {
+            ioctl(group, PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+        }
+#else
+        error = "perf_event_open is available only on Linux";
+#endif
+    }
+
+    ~PerfProfiler() {
+#ifdef __linux__
+        for (int fd : fds) {
+            close(fd);
+        }
+
+        if (group >= 0) {
+            close(group);
+        }
+#endif
+    }
+
+    /**
+     * Return true, if at least one hardware counter could be opened.
+     */
+    bool available() const {
+        return group >= 0;
+    }
+
+    /**
+     * Why some counters could not be opened, empty when all of them are counting.
+     */
+    const std::string &unavailable_reason() const {
+        return error;
+    }
+
+    /**
+     * Following phases belong to the given level. Levels played again add to their first row.
+     */
+    void level(int level_no, const char *title) {
+        leave();
+
+        for (size_t i = 0; i < rows.size(); ++i) {
+            if (rows[i].level_no == level_no) {
+                row = (int)i;
+                return;
+            }
+        }
+
+        Row added;
+        added.level_no = level_no;
+        added.title.assign(title, Level::LEVEL_NAME_LENGTH);
+        added.title.erase(added.title.find_last_not_of(' ') + 1);
+        memset(added.phases, 0, sizeof(added.phases));
+
+        rows.push_back(added);
+        row = (int)rows.size() - 1;
+    }
+
+    /**
+     * Finish the current phase, if any, and start the given one.
+     */
+    void enter(Phase phase) {
+        Sample now;
+        sample(now);
+
+        if (current != PHASE_NONE && row >= 0) {
+            Totals &totals = rows[row].phases[current];
+            ++totals.calls;
+            totals.ns += now.ns - start.ns;
+            for (int c = 0; c < COUNTER_COUNT; ++c) {
+                totals.values[c] += now.values[c] - start.values[c];
+            }
+        }
+
+        start = now;
+        current = phase;
+    }
+
+    /**
+     * Finish the current phase, time until the next enter() is not counted.
+     */
+    void leave() {
+        if (current != PHASE_NONE) {
+            enter(PHASE_NONE);
+        }
+    }
+
+    void report(FILE *out) const {
+        if (!available()) {
+            fprintf(out, "Hardware counters are not available (%s), only time is reported.\n", error.c_str());
+        } else if (!error.empty()) {
+            fprintf(out, "Some hardware counters are not available (%s).\n", error.c_str());
+        }
+
+        fprintf(out, "%3s %-23s %-7s %8s %10s %11s %5s %9s %9s\n", "#", "title", "phase", "calls", "ns/call",
+            "cycles/call", "IPC", "cache/ki", "branch/ki");
+
+        Row all;
+        all.level_no = 0;
+        all.title = "all levels";
+        memset(all.phases, 0, sizeof(all.phases));
+
+        for (const Row &level : rows) {
+            report_row(out, level);
+
+            for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+                all.phases[phase].calls += level.phases[phase].calls;
+                all.phases[phase].ns += level.phases[phase].ns;
+                for (int c = 0; c < COUNTER_COUNT; ++c) {
+                    all.phases[phase].values[c] += level.phases[phase].values[c];
+                }
+            }
+        }
+
+        if (rows.size() > 1) {
+            report_row(out, all);
+        }
+    }
+
+    /**
+     * Write totals of every level and phase as JSON, counters that are not available are null.
+     */
+    bool write_json(const char *file_name) const {
+        FILE *f = fopen(file_name, "w");
+        if (!f) {
+            return false;
+        }
+
+        fprintf(f, "{\"counters\":%s,\"levels\":[\n", available() ? "true" : "false");
+
+        for (size_t i = 0; i < rows.size(); ++i) {
+            std::string title = rows[i].title;
+            std::replace(title.begin(), title.end(), '"', '\'');
+
+            fprintf(f, "%s{\"level\":%d,\"title\":\"%s\"", i > 0 ? ",\n" : "", rows[i].level_no, title.c_str());
+
+            for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+                const Totals &totals = rows[i].phases[phase];
+                fprintf(f, ",\"%s\":{\"calls\":%llu,\"ns\":%llu", phase_name(phase),
+                    (unsigned long long)totals.calls, (unsigned long long)totals.ns);
+
+                for (int c = 0; c < COUNTER_COUNT; ++c) {
+                    if (slot[c] >= 0) {
+                        fprintf(f, ",\"%s\":%llu", counter_name(c), (unsigned long long)totals.values[c]);
+                    } else {
+                        fprintf(f, ",\"%s\":null", counter_name(c));
+                    }
+                }
+
+                fprintf(f, "}");
+            }
+
+            fprintf(f, "}");
+        }
+
+        fprintf(f, "\n]}\n");
+
+        return fclose(f) == 0;
+    }
+
+protected:
+    struct Sample {
+        uint64_t ns;
+        uint64_t values[COUNTER_COUNT];
+    };
+
+    int group;               /**< Group leader, -1 when no counter could be opened. */
+    std::vector<int> fds;    /**< Other members of the group. */
+    int slot[COUNTER_COUNT]; /**< Position of each counter in the group read, -1 when it is not available. */
+    int opened;
+    std::string error;
+
+    std::vector<Row> rows;
+    Phase current;
+    int row;
+    Sample start;
+
+    void sample(Sample &sample) const {
+        sample.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+        memset(sample.values, 0, sizeof(sample.values));
+
+#ifdef __linux__
+        if (group < 0) {
+            return;
+        }
+
+        // PERF_FORMAT_GROUP: number of counters, then their values in the order they were opened.
+        uint64_t data[1 + COUNTER_COUNT];
+        if (read(group, data, sizeof(data)) < (ssize_t)(sizeof(uint64_t) * (1 + opened))) {
+            return;
+        }
+
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            if (slot[c] >= 0) {
+                sample.values[c] = data[1 + slot[c]];
+            }
+        }
+#endif
+    }
+
+    void report_row(FILE *out, const Row &level) const {
+        for (int phase = 0; phase < PHASE_COUNT; ++phase) {
+            const Totals &totals = level.phases[phase];
+            if (totals.calls == 0) {
+                continue;
+            }
+
+            char number[12] = "";
+            if (level.level_no > 0) {
+                snprintf(number, sizeof(number), "%d", level.level_no);
+            }
+
+            fprintf(out, "%3s %-23.23s %-7s %8llu %10.0f", number, level.title.c_str(), phase_name(phase),
+                (unsigned long long)totals.calls, (double)totals.ns / totals.calls);
+
+            const uint64_t *values = totals.values;
+            bool cycles = slot[COUNTER_CYCLES] >= 0;
+            bool instructions = slot[COUNTER_INSTRUCTIONS] >= 0;
+            double kilo_instructions = std::max(1.0, values[COUNTER_INSTRUCTIONS] / 1000.0);
+
+            print_value(out, cycles, 11, 0, (double)values[COUNTER_CYCLES] / totals.calls);
+            print_value(out, cycles && instructions, 5, 2,
+                (double)values[COUNTER_INSTRUCTIONS] / std::max<uint64_t>(1, values[COUNTER_CYCLES]));
+            print_value(out, instructions && slot[COUNTER_CACHE_MISSES] >= 0, 9, 2,
+                values[COUNTER_CACHE_MISSES] / kilo_instructions);
+            print_value(out, instructions && slot[COUNTER_BRANCH_MISSES] >= 0, 9, 2,
+                values[COUNTER_BRANCH_MISSES] / kilo_instructions);
+            fprintf(out, "\n");
+        }
+    }
+
+    /**
+     * Print the value, or n/a in the same width when the counters it is computed from are not available.
+     */
+    static void print_value(FILE *out, bool known, int width, int precision, double value) {
+        if (known) {
+            fprintf(out, " %*.*f", width, precision, value);
+        } else {
+            fprintf(out, " %*s", width, "n/a");
+        }
+    }
+
+    static const char *phase_name(int phase) {
+        switch (phase) {
+            case PHASE_INPUT:   return "input";
+            case PHASE_STEP:    return "step";
+            case PHASE_DRAW:    return "draw";
+            case PHASE_PRESENT: return "present";
+            default:            return "none";
+        }
+    }
+
+    static const char *counter_name(int counter) {
+        switch (counter) {
+            case COUNTER_CYCLES:        return "cycles";
+            case COUNTER_INSTRUCTIONS:  return "instructions";
+            case COUNTER_CACHE_MISSES:  return "cache_misses";
+            default:                    return "branch_misses";
+        }
+    }
+};
+
+/**
+ * Publishes game state after every game step, and optionally every rendered frame, to shared memory rings, so that
+ * local tools (bots, overlays, recorders) can follow the game without slowing it down. See shm_ring.h for the layout
+ * and tools/shm_reader.cc for a consumer.
+ */
+class StatePublisher {
+public:
+    static const uint32_t STATE_SLOTS = 64;
+    static const uint32_t FRAME_SLOTS = 4;
+
+    StatePublisher(): frames(false), frame_no(0), frames_skipped(0) {}
+
+    /**
+     * Create the shared memory objects. Frames are published only when with_frames is set.
+     */
+    bool open(bool with_frames) {
+#ifndef _WIN32
+        frames = with_frames;
+        return state_ring.create(SHM_STATE_NAME, STATE_SLOTS, sizeof(ShmStatePayload));
+#else
+        (void)with_frames;
+        return false;
+#endif
+    }
+
+    void publish_state(const Level &level) {
+#ifndef _WIN32
+        static_assert(ShmStatePayload::WIDTH == Level::LEVEL_WIDTH && ShmStatePayload::HEIGHT == Level::LEVEL_HEIGHT,
+            "Published state does not match level size.");
+
+        ShmStatePayload *state = (ShmStatePayload *)state_ring.begin();
+
+        state->step = level.steps_done();
+        state->murphy_x = level.murphy_position().x;
+        state->murphy_y = level.murphy_position().y;
+        state->murphy_alive = level.murphy_alive;
+        state->infotrons_collected = level.infotrons_collected;
+
+        for (int i = 0; i < Level::LEVEL_WIDTH * Level::LEVEL_HEIGHT; ++i) {
+            const Field &fld = level.field(i);
+            state->types[i] = fld.type;
+            state->hints[i] = fld.hint;
+        }
+
+        state_ring.commit(sizeof(ShmStatePayload));
+#else
+        (void)level;
+#endif
+    }
+
+    void publish_frame(SDL_Surface *screen) {
+#ifndef _WIN32
+        if (!frames) {
+            return;
+        }
+
+        uint32_t size = sizeof(ShmFramePayload) + screen->h * screen->pitch;
+
+        // Frame ring is sized by the first frame, bigger frames (after the window grows) are skipped.
+        if (frame_no == 0 && !frame_ring.create(SHM_FRAME_NAME, FRAME_SLOTS, size)) {
+            fprintf(stderr, "Unable to create %s, frames will not be published.\n", SHM_FRAME_NAME);
+            frames = false;
+            return;
+        }
+
+        ++frame_no;
+
+        if (size > frame_ring.capacity()) {
+            ++frames_skipped;
+            return;
+        }
+
+        ShmFramePayload *frame = (ShmFramePayload *)frame_ring.begin();
+        frame->frame = frame_no;
+        frame->width = screen->w;
+        frame->height = screen->h;
+        frame->pitch = screen->pitch;
+        frame->pixel_format = screen->format->format;
+
+        SDL_LockSurface(screen);
+        memcpy(frame + 1, screen->pixels, screen->h * screen->pitch);
+        SDL_UnlockSurface(screen);
+
+        frame_ring.commit(size);
+#else
+        (void)screen;
+#endif
+    }
+
+    int skipped_frames() const {
+        return frames_skipped;
+    }
+
+protected:
+#ifndef _WIN32
+    ShmRingWriter state_ring;
+    ShmRingWriter frame_ring;
+#endif
+    bool frames;
+    uint64_t frame_no;
+    int frames_skipped;
+};
+
+/**
+ * Abstract class that represents UI.
+ */
+class Drawer {
+public:
+    virtual ~Drawer() {}
+
+    /**
+     * Handle input events. Return true, if the loop should continue, false if the game should be aborted.
+     */
+    virtual bool handle_input(Level *game) = 0;
+
+    /**
+     * Draw game field to the screen. Phase is time elapsed in current game step, from 0 when the step has been done
+     * to 1 when next step is due.
+     */
+    virtual void draw(Level *game, float phase) = 0;
+
+    /**
+     * Return number of animation frames for each game step.
+     */
+    virtual int animation_frames() = 0;
+
+    /**
+     * Return refresh rate of the display, 0 if it is unknown.
+     */
+    virtual int refresh_rate() {
+        return 0;
+    }
+
+    /**
+     * Game speed chosen by the player, number of game steps done in the time of one normal step.
+     */
+    virtual int speed() {
+        return 1;
+    }
+
+    /**
+     * Return true, if the next frame would differ from the last one even when the level has not changed since it was
+     * drawn (animation in flight, window exposed or resized).
+     */
+    virtual bool needs_redraw(const Level *) {
+        return true;
+    }
+
+    /**
+     * Block until given time, drawers that can be woken up by their input may return earlier.
+     */
+    virtual void wait(std::chrono::steady_clock::time_point until) {
+        std::this_thread::sleep_until(until);
+    }
+
+    /**
+     * Attach tracer that gets notified when input is received, dispatched, drawn and presented.
+     */
+    void set_latency_tracer(LatencyTracer *tracer) {
+        this->tracer = tracer;
+    }
+
+    /**
+     * Attach publisher that gets every rendered frame.
+     */
+    void set_publisher(StatePublisher *publisher) {
+        this->publisher = publisher;
+    }
+
+    /**
+     * Attach profiler, draw() marks where presenting the frame starts.
+     */
+    void set_profiler(PerfProfiler *profiler) {
+        this->profiler = profiler;
+    }
+
+    /**
+     * Store drawer's part of the game state.
+     */
+    virtual void save_state(SaveState &state) = 0;
+
+    /**
+     * Restore drawer's part of the game state.
+     */
+    virtual void load_state(const SaveState &state) = 0;
+
+protected:
+    LatencyTracer *tracer = nullptr;
+    StatePublisher *publisher = nullptr;
+    PerfProfiler *profiler = nullptr;
+};
+
+/**
+ * SDL based interface.
+ */
+class SDLDrawer: public Drawer {
+public:
+    static const int FIELD_WIDTH = 16;
+    static const int FIELD_HEIGHT = 16;
+
+    static constexpr const char *FIXED_FILE = "FIXED.bmp";
+    static constexpr const char *MOVING_FILE = "MOVING2.bmp";
+
+    /**
+     * Size and modification time of the file, left unchanged when the file does not exist.
+     */
+    static void file_stamp(const char *file_name, int64_t &size, int64_t &mtime) {
+        struct stat st;
+        if (stat(file_name, &st) == 0) {
+            size = st.st_size;
+            mtime = st.st_mtime;
+        }
+    }
+
+    /**
+     * atlas_cache is file name where converted sprites are kept between runs, nullptr disables the cache. Frames are
+     * split into given number of horizontal bands, each drawn by its own thread.
+     */
+    SDLDrawer(const char *atlas_cache = nullptr, int threads = 1): fixed_native(nullptr), moving_native(nullptr),
+        fixed(nullptr), moving(nullptr), scale(1), atlas_cache(atlas_cache), camera_x(0), camera_y(0),
+        last_murphy_side_move(DIR_LEFT), turbo(false), turbo_speed(8), animated(false), dirty(true), threads(std::max(1, threads)),
+        band_screen(nullptr), band_pixels(nullptr), generation(0), pending(0), quit(false)
+    {
+        SDL_Init(SDL_INIT_VIDEO);
+        window = SDL_CreateWindow("Supaplex", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, FIELD_WIDTH * 60, FIELD_HEIGHT * 24, SDL_WINDOW_RESIZABLE);
+
+        load_atlas(SDL_GetWindowSurface(window)->format);
+
+        for (int i = 1; i < this->threads; ++i) {
+            workers.emplace_back(&SDLDrawer::work, this, i);
+        }
+    }
+
+    ~SDLDrawer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+
+        wake.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        free_bands();
+
+        SDL_FreeSurface(fixed);
+        SDL_FreeSurface(moving);
+        SDL_FreeSurface(fixed_native);
+        SDL_FreeSurface(moving_native);
+
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+    }
+
+    bool handle_input(Level *level) {
+        SDL_Event polled;
+        while (SDL_PollEvent(&polled)) {
+            deferred.push_back(polled);
+        }
+
+        for (const SDL_Event &event : deferred) {
+            switch (event.type) {
+                case SDL_QUIT:
+                    deferred.clear();
+                    return false;
+
+                case SDL_WINDOWEVENT:
+                    dirty = true;
+                    break;
+
+                case SDL_KEYDOWN:
+                    if (tracer && !event.key.repeat) {
+                        switch (event.key.keysym.sym) {
+                            case SDLK_UP:
+                            case SDLK_DOWN:
+                            case SDLK_LEFT:
+                            case SDLK_RIGHT:
+                                tracer->input(event.key.timestamp, SDL_GetTicks());
+                                break;
+                        }
+                    }
+
+                    switch (event.key.keysym.sym) {
+                        case SDLK_UP:
+                            if (keyboard_down[KBD_UP] == 0) {
+                                keyboard_down[KBD_UP] = 1;
+                            }
+                            break;
+
+                        case SDLK_DOWN:
+                            if (keyboard_down[KBD_DOWN] == 0) {
+                                keyboard_down[KBD_DOWN] = 1;
+                            }
+                            break;
+
+                        case SDLK_LEFT:
+                            if (keyboard_down[KBD_LEFT] == 0) {
+                                keyboard_down[KBD_LEFT] = 1;
+                            }
+                            break;
+
+                        case SDLK_RIGHT:
+                            if (keyboard_down[KBD_RIGHT] == 0) {
+                                keyboard_down[KBD_RIGHT] = 1;
+                            }
+                            break;
+
+                        case SDLK_SPACE:
+                            keyboard_down[KBD_SPACE] = 1;
+                            break;
+                    }
+                    break;
+
+                case SDL_KEYUP:
+                    switch (event.key.keysym.sym) {
+                        case SDLK_UP:
+                            if (keyboard_down[KBD_UP] == 1) {
+                                // was up, but only for this round, will go down after processed.
+                                keyboard_down[KBD_UP] = 3;
+                            } else if (keyboard_down[KBD_UP] == 2) {
+                                // was up, goes immediately down.
+                                keyboard_down[KBD_UP] = 0;
+                            }
+                            break;
+
+                        case SDLK_DOWN:
+                            if (keyboard_down[KBD_DOWN] == 1) {
+                                keyboard_down[KBD_DOWN] = 3;
+                            } else if (keyboard_down[KBD_DOWN] == 2) {
+                                keyboard_down[KBD_DOWN] = 0;
+                            }
+                            break;
+
+                        case SDLK_LEFT:
+                            if (keyboard_down[KBD_LEFT] == 1) {
+                                keyboard_down[KBD_LEFT] = 3;
+                            } else if (keyboard_down[KBD_LEFT] == 2) {
+                                keyboard_down[KBD_LEFT] = 0;
+                            }
+                            break;
+
+                        case SDLK_RIGHT:
+                            if (keyboard_down[KBD_RIGHT] == 1) {
+                                keyboard_down[KBD_RIGHT] = 3;
+                            } else if (keyboard_down[KBD_RIGHT] == 2) {
+                                keyboard_down[KBD_RIGHT] = 0;
+                            }
+                            break;
+
+                        case SDLK_SPACE:
+                            keyboard_down[KBD_SPACE] = 0;
+                            break;
+
+                        case SDLK_ESCAPE:
+                            level->dispatch_event(EVENT_END_GAME);
+                            break;
+
+                        case SDLK_F5:
+                            quick_save(level);
+                            break;
+
+                        case SDLK_F9:
+                            quick_load(level);
+                            break;
+
+                        case SDLK_TAB:
+                            turbo = !turbo;
+                            show_speed();
+                            break;
+
+                        case SDLK_PAGEUP:
+                            turbo_speed = std::min(MAX_TURBO_SPEED, turbo_speed * 2);
+                            show_speed();
+                            break;
+
+                        case SDLK_PAGEDOWN:
+                            turbo_speed = std::max(2, turbo_speed / 2);
+                            show_speed();
+                            break;
+                    }
+                    break;
+            }
+        }
+
+        deferred.clear();
+
+        GameEvent move = EVENT_MOVE_NONE;
+        if (keyboard_down[KBD_UP] > 0) {
+            move = EVENT_MOVE_UP;
+        } else if (keyboard_down[KBD_DOWN] > 0) {
+            move = EVENT_MOVE_DOWN;
+        } else if (keyboard_down[KBD_LEFT] > 0) {
+            move = EVENT_MOVE_LEFT;
+        } else if (keyboard_down[KBD_RIGHT] > 0) {
+            move = EVENT_MOVE_RIGHT;
+        }
+
+        level->dispatch_event(move);
+
+        if (keyboard_down[KBD_UP] == 3) {
+            keyboard_down[KBD_UP] = 0;
+        } else if (keyboard_down[KBD_UP] == 1) {
+            keyboard_down[KBD_UP] = 2;
+        }
+
+        if (keyboard_down[KBD_DOWN] == 3) {
+            keyboard_down[KBD_DOWN] = 0;
+        } else if (keyboard_down[KBD_DOWN] == 1) {
+            keyboard_down[KBD_DOWN] = 2;
+        }
+
+        if (keyboard_down[KBD_LEFT] == 3) {
+            keyboard_down[KBD_LEFT] = 0;
+        } else if (keyboard_down[KBD_LEFT] == 1) {
+            keyboard_down[KBD_LEFT] = 2;
+        }
+
+        if (keyboard_down[KBD_RIGHT] == 3) {
+            keyboard_down[KBD_RIGHT] = 0;
+        } else if (keyboard_down[KBD_RIGHT] == 1) {
+            keyboard_down[KBD_RIGHT] = 2;
+        }
+
+        if (keyboard_down[KBD_SPACE]) {
+            level->dispatch_event(EVENT_BTN_SPECIAL_DOWN);
+        } else {
+            level->dispatch_event(EVENT_BTN_SPECIAL_UP);
+        }
+
+        if (tracer && move != EVENT_MOVE_NONE) {
+            tracer->mark(LatencyTracer::STAGE_DISPATCH);
+        }
+
+        return true;
+    }
+
+    void draw(Level *level, float phase) {
+        SDL_Surface *screen = SDL_GetWindowSurface(window);
+        prepare_atlas(screen);
+        prepare_bands(screen);
+
+        int tile_w = FIELD_WIDTH * scale;
+        int tile_h = FIELD_HEIGHT * scale;
+
+        // Sprites slide by whole pixels, animated sprites show the frame for the current part of the step.
+        frame.level = level;
+        frame.move_offset = (int)(tile_h * phase);
+        frame.animation_frame = std::min(animation_frames() - 1, (int)(phase * animation_frames()));
+
+        update_camera(level, screen, frame.move_offset);
+
+        // Only fields in the viewport are drawn, plus one field around it for sprites that slide in.
+        frame.first_x = std::max(0, camera_x / tile_w - 1);
+        frame.first_y = std::max(0, camera_y / tile_h - 1);
+        frame.last_x = std::min(level->width(), (camera_x + screen->w) / tile_w + 2);
+        frame.last_y = std::min(level->height(), (camera_y + screen->h) / tile_h + 2);
+
+        // Level does not cover the whole window.
+        frame.fill = camera_x < 0 || camera_y < 0 || level->width() * tile_w - camera_x < screen->w
+            || level->height() * tile_h - camera_y < screen->h;
+
+        // Murphy moving up or down keeps facing his last side move, bands only read it.
+        for (int ly = frame.first_y; ly < frame.last_y; ++ly) {
+            for (int lx = frame.first_x; lx < frame.last_x; ++lx) {
+                const Field &field = level->field(lx, ly);
+                if (field.type != FT_MURPHY || (field.hint & (HINT_EXPLOSION | HINT_PUSH))) {
+                    continue;
+                }
+
+                if (field.hint & HINT_FROM_LEFT) {
+                    last_murphy_side_move = DIR_RIGHT;
+                } else if (field.hint & HINT_FROM_RIGHT) {
+                    last_murphy_side_move = DIR_LEFT;
+                }
+            }
+        }
+
+        if (bands.size() > 1) {
+            if (SDL_MUSTLOCK(screen)) {
+                SDL_LockSurface(screen);
+            }
+
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                pending = workers.size();
+                ++generation;
+            }
+
+            wake.notify_all();
+            draw_band(bands[0]);
+
+            {
+                std::unique_lock<std::mutex> lock(mutex);
+                done.wait(lock, [this]() { return pending == 0; });
+            }
+
+            if (SDL_MUSTLOCK(screen)) {
+                SDL_UnlockSurface(screen);
+            }
+        } else {
+            draw_band(bands[0]);
+        }
+
+        animated = false;
+        for (const Band &band : bands) {
+            animated |= band.animated;
+        }
+
+        dirty = false;
+
+        if (tracer) {
+            tracer->mark(LatencyTracer::STAGE_DRAW);
+        }
+
+        if (profiler) {
+            profiler->enter(PerfProfiler::PHASE_PRESENT);
+        }
+
+        if (publisher) {
+            publisher->publish_frame(screen);
+        }
+
+        SDL_UpdateWindowSurface(window);
+
+        if (tracer) {
+            tracer->mark(LatencyTracer::STAGE_PRESENT);
+        }
+    }
+
+    int animation_frames() {
+        return 8;
+    }
+
+    /**
+     * Tab switches turbo on and off, Page Up and Page Down double and halve its speed.
+     */
+    int speed() {
+        return turbo ? turbo_speed : 1;
+    }
+
+    /**
+     * Window needs drawing while sprites slide or animate, and after it has been exposed or resized.
+     */
+    bool needs_redraw(const Level *) {
+        return animated || dirty;
+    }
+
+    /**
+     * Sleep in SDL_WaitEventTimeout(), so window events are redrawn right away. Other events stay for the next
+     * handle_input(), which is done only between game steps.
+     */
+    void wait(std::chrono::steady_clock::time_point until) {
+        typedef std::chrono::steady_clock Clock;
+
+        while (!dirty) {
+            Clock::time_point now = Clock::now();
+            if (now >= until) {
+                break;
+            }
+
+            // Round up, waking up before the deadline would only wait again.
+            int timeout = (int)((std::chrono::duration_cast<std::chrono::microseconds>(until - now).count() + 999) / 1000);
+            SDL_Event event;
+            if (!SDL_WaitEventTimeout(&event, timeout)) {
+                continue;
+            }
+
+            if (event.type == SDL_WINDOWEVENT) {
+                dirty = true;
+            } else {
+                deferred.push_back(event);
+                if (event.type == SDL_QUIT) {
+                    break;
+                }
+            }
+        }
+    }
+
+    int refresh_rate() {
+        SDL_DisplayMode mode;
+        if (SDL_GetWindowDisplayMode(window, &mode) == 0) {
+            return mode.refresh_rate;
+        }
+
+        return 0;
+    }
+
+    /**
+     * Window surface with the last drawn frame.
+     */
+    SDL_Surface *surface() {
+        return SDL_GetWindowSurface(window);
+    }
+
+    void resize(int width, int height) {
+        SDL_SetWindowSize(window, width, height);
+    }
+
+    void save_state(SaveState &state) {
+        state.last_murphy_side_move = last_murphy_side_move;
+    }
+
+    void load_state(const SaveState &state) {
+        last_murphy_side_move = (Direction)state.last_murphy_side_move;
+    }
+
+protected:
+    static const int KBD_UP = 0;
+    static const int KBD_DOWN = 1;
+    static const int KBD_LEFT = 2;
+    static const int KBD_RIGHT = 3;
+    static const int KBD_SPACE = 4;
+
+    static constexpr const char *QUICK_SAVE_FILE = "SAVESTATE.DAT";
+
+    static const int MAX_TURBO_SPEED = 64;
+
+    static const uint32_t ATLAS_CACHE_MAGIC = 0x534c5441; /**< "ATLS" */
+
+    /**
+     * Atlas cache is valid only for the same bitmaps converted to the same pixel format.
+     */
+    struct AtlasCacheHeader {
+        uint32_t magic;
+        uint32_t pixel_format;
+        uint32_t bytes_per_pixel;
+        uint32_t reserved;
+        int64_t fixed_size;
+        int64_t fixed_mtime;
+        int64_t moving_size;
+        int64_t moving_mtime;
+        int32_t fixed_w;
+        int32_t fixed_h;
+        int32_t moving_w;
+        int32_t moving_h;
+    };
+
+    SDL_Window *window;
+    SDL_Surface *fixed_native;  /**< Sprites converted to window pixel format. */
+    SDL_Surface *moving_native;
+    SDL_Surface *fixed;         /**< Sprites scaled by current scale, these are used for drawing. */
+    SDL_Surface *moving;
+    int scale;
+    const char *atlas_cache;
+
+    int camera_x; /**< Level pixel shown in the top left corner of the window. */
+    int camera_y;
+
+    int keyboard_down[5];
+    Direction last_murphy_side_move;
+
+    bool turbo;
+    int turbo_speed; /**< Game steps per normal step when turbo is on. */
+
+    bool animated; /**< Last frame had sliding or animated sprites. */
+    bool dirty;    /**< Window has to be drawn even if the level has not changed. */
+
+    std::vector<SDL_Event> deferred; /**< Events received by wait(), handled by the next handle_input(). */
+
+    /**
+     * Horizontal part of the window drawn by one thread.
+     */
+    struct Band {
+        SDL_Surface *screen; /**< Rows top to bottom of the window surface. */
+        SDL_Surface *fixed;  /**< Sprites, each band blits from its own surfaces as a blit changes its source. */
+        SDL_Surface *moving;
+        int top;
+        int bottom;
+        bool animated;       /**< Band has drawn sliding or animated sprites. */
+    };
+
+    /**
+     * What all bands of the current frame share, set before they are drawn.
+     */
+    struct Frame {
+        Level *level;
+        int move_offset;
+        int animation_frame;
+        int first_x;
+        int first_y;
+        int last_x;
+        int last_y;
+        bool fill;
+    };
+
+    int threads;
+    std::vector<Band> bands;
+    Frame frame;
+
+    SDL_Surface *band_screen; /**< Window surface the bands have been made for. */
+    void *band_pixels;
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    uint64_t generation; /**< Number of frames handed to workers. */
+    size_t pending;      /**< Workers that have not finished the current frame yet. */
+    bool quit;
+
+    void work(int part) {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t drawn = 0;
+
+        while (true) {
+            wake.wait(lock, [&]() { return generation != drawn || quit; });
+            if (quit) {
+                return;
+            }
+
+            drawn = generation;
+
+            lock.unlock();
+            if (part < (int)bands.size()) {
+                draw_band(bands[part]);
+            }
+            lock.lock();
+
+            if (--pending == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    /**
+     * Split the window surface into one band per thread. One band draws straight to the window, more bands draw to
+     * surfaces that share the window pixels, so every band is clipped to its own rows.
+     */
+    void prepare_bands(SDL_Surface *screen) {
+        if (!bands.empty() && band_screen == screen && band_pixels == screen->pixels
+            && bands[0].screen->w == screen->w && bands[0].screen->pitch == screen->pitch
+            && bands.back().bottom == screen->h)
+        {
+            return;
+        }
+
+        free_bands();
+        band_screen = screen;
+        band_pixels = screen->pixels;
+
+        int count = std::max(1, std::min(threads, screen->h));
+        if (count == 1) {
+            bands.push_back(Band{ screen, fixed, moving, 0, screen->h, false });
+            return;
+        }
+
+        for (int i = 0; i < count; ++i) {
+            Band band;
+            band.top = screen->h * i / count;
+            band.bottom = screen->h * (i + 1) / count;
+            band.screen = SDL_CreateRGBSurfaceWithFormatFrom((uint8_t *)screen->pixels + band.top * screen->pitch,
+                screen->w, band.bottom - band.top, screen->format->BitsPerPixel, screen->pitch, screen->format->format);
+            band.fixed = share_surface(fixed);
+            band.moving = share_surface(moving);
+            band.animated = false;
+            bands.push_back(band);
+        }
+    }
+
+    void free_bands() {
+        if (bands.size() > 1) {
+            for (Band &band : bands) {
+                SDL_FreeSurface(band.screen);
+                SDL_FreeSurface(band.fixed);
+                SDL_FreeSurface(band.moving);
+            }
+        }
+
+        bands.clear();
+    }
+
+    /**
+     * New surface with the pixels and blend mode of given one.
+     */
+    static SDL_Surface *share_surface(SDL_Surface *surface) {
+        SDL_Surface *shared = SDL_CreateRGBSurfaceWithFormatFrom(surface->pixels, surface->w, surface->h,
+            surface->format->BitsPerPixel, surface->pitch, surface->format->format);
+
+        SDL_BlendMode mode;
+        SDL_GetSurfaceBlendMode(surface, &mode);
+        SDL_SetSurfaceBlendMode(shared, mode);
+
+        return shared;
+    }
+
+    /**
+     * Draw fields that reach the band, clipped to it. Blits are done in the same order as for the whole window,
+     * so the bands together are pixel identical to drawing in one thread.
+     */
+    void draw_band(Band &band) {
+        SDL_Surface *screen = band.screen;
+        SDL_Surface *fixed = band.fixed;
+        SDL_Surface *moving = band.moving;
+        Level *level = frame.level;
+
+        int tile_w = FIELD_WIDTH * scale;
+        int tile_h = FIELD_HEIGHT * scale;
+        int move_offset = frame.move_offset;
+        int animation_frame = frame.animation_frame;
+
+        // Band surface starts at its top row of the window.
+        int origin_y = camera_y + band.top;
+        int rows = band.bottom - band.top;
+
+        SDL_Rect source;
+        source.x = 0;
+        source.y = 0;
+        source.w = tile_w;
+        source.h = tile_h;
+
+        SDL_Rect dest;
+        dest.x = 0;
+        dest.y = 0;
+        dest.w = tile_w;
+        dest.h = tile_h;
+
+        SDL_Rect source_empty;
+        source_empty.x = 0;
+        source_empty.y = 0;
+        source_empty.w = tile_w;
+        source_empty.h = tile_h;
+
+        SDL_Rect source_infotron = source_empty;
+        source_infotron.x = tile_w * FT_INFOTRON;
+
+        SDL_Rect source_base = source_empty;
+        source_base.x = tile_w * FT_BASE;
+
+        SDL_Rect source_red_disk = source_empty;
+        source_red_disk.x = tile_w * FT_RED_DISK;
+
+        SDL_Surface *source_surface;
+
+        if (frame.fill) {
+            SDL_FillRect(screen, nullptr, 0);
+        }
+
+        band.animated = false;
+
+        // Draw static fields.
+        for (int ly = frame.first_y; ly < frame.last_y; ++ly) {
+            if (ly * tile_h - origin_y >= rows || (ly + 1) * tile_h - origin_y <= 0) {
+                continue;
+            }
+
+            for (int lx = frame.first_x; lx < frame.last_x; ++lx) {
+                dest.y = ly * tile_h - origin_y;
+                dest.x = lx * tile_w - camera_x;
+
+                Field &field = level->field(lx, ly);
+
+                source.y = 0;
+                source.x = field.type * tile_w;
+
+                SDL_BlitSurface(fixed, &source, screen, &dest);
+            }
+        }
+
+        // Sliding sprites reach one field up or down.
+        for (int ly = frame.first_y; ly < frame.last_y; ++ly) {
+            if ((ly - 1) * tile_h - origin_y >= rows || (ly + 2) * tile_h - origin_y <= 0) {
+                continue;
+            }
+
+            for (int lx = frame.first_x; lx < frame.last_x; ++lx) {
+                dest.y = ly * tile_h - origin_y;
+                dest.x = lx * tile_w - camera_x;
+
+                source_surface = fixed;
+
+                bool need_draw = false;
+
+                Field &field = level->field(lx, ly);
+
+                source.y = 0;
+                source.x = field.type * tile_w;
+
+                if (field.has_hint(HINT_FALL) || field.has_hint(HINT_FROM_TOP) || field.has_hint(HINT_FROM_BOTTOM)
+                        || field.has_hint(HINT_FROM_LEFT) || field.has_hint(HINT_FROM_RIGHT)) {
+
+                    // Blit clips its destination rectangle, the sprite is placed from the unclipped one.
+                    SDL_Rect under = dest;
+
+                    if (field.has_hint(HINT_WAS_INFOTRON)) {
+                        SDL_BlitSurface(fixed, &source_infotron, screen, &under);
+                    } else if (field.has_hint(HINT_WAS_BASE)) {
+                        SDL_BlitSurface(fixed, &source_base, screen, &under);
+                    } else if (field.has_hint(HINT_WAS_RED_DISK)) {
+                        SDL_BlitSurface(fixed, &source_red_disk, screen, &under);
+                    } else {
+                        SDL_BlitSurface(fixed, &source_empty, screen, &under);
+                    }
+
+                    need_draw = true;
+                } else if (field.has_hint(HINT_WAS_INFOTRON | HINT_WAS_BASE | HINT_WAS_RED_DISK)) {
+                    // Draw remote eating animation
+                    // 22, 23, 24
+                    source_surface = moving;
+                    source.x = animation_frame * tile_w;
+
+                    if (field.has_hint(HINT_WAS_BASE)) {
+                        source.y = 21 * tile_h;
+                    } else if (field.has_hint(HINT_WAS_INFOTRON)) {
+                        source.y = 22 * tile_h;
+                    } else if (field.has_hint(HINT_WAS_RED_DISK)) {
+                        source.y = 23 * tile_h;
+                    }
+
+                    need_draw = true;
+                }
+
+                if (field.has_hint(HINT_FALL)) {
+                    dest.y = dest.y - tile_h + move_offset;
+                } else if (field.has_hint(HINT_FROM_TOP) && !field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
+                    dest.y = dest.y - tile_h + move_offset;
+                } else if (field.has_hint(HINT_FROM_BOTTOM) && !field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
+                    dest.y = dest.y + tile_h - move_offset;
+                } else if (field.has_hint(HINT_FROM_LEFT) && !field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
+                    dest.x = dest.x - tile_h + move_offset;
+                } else if (field.has_hint(HINT_FROM_RIGHT) && !field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
+                    dest.x = dest.x + tile_h - move_offset;
+                }
+
+                if (has_animation(field)) {
+                    source_surface = moving;
+                    need_draw = true;
+
+                    int turn_offset = 0;
+                    if (field.has_hint(HINT_TURN_LEFT)) {
+                        turn_offset = 4;
+                    } else if (field.has_hint(HINT_TURN_RIGHT)) {
+                        turn_offset = 8;
+                    }
+
+                    if (field.has_hint(HINT_EXPLOSION)) {
+                        // Extend explosion animation to 4 game steps.
+                        source.x = ((animation_frame >> 2) + ((EXPLOSION_STEPS - field.countdown) << 1)) * tile_w;
+                        source.y = 6 * tile_h;
+                    }
+
+                    else if (field.has_hint(HINT_FROM_LEFT)
+                            || (field.type == FT_MURPHY && last_murphy_side_move == DIR_RIGHT &&
+                                field.has_hint(HINT_FROM_TOP | HINT_FROM_BOTTOM)))
+                    {
+                        source.x = animation_frame * tile_w;
+
+                        switch (field.type) {
+                            case FT_MURPHY:
+								if (!field.has_hint(HINT_PUSH)) {
+									source.y = 1 * tile_h;
+								}
+								else {
+									source.x = 0 * tile_w;
+									source.y = 20 * tile_h;
+								}
+                                break;
+
+                            case FT_ZONK:
+                                source.y = 3 * tile_h;
+                                break;
+
+                            case FT_INFOTRON:
+                                source.y = 5 * tile_h;
+                                break;
+
+                            case FT_SNIK_SNAK:
+                                source.y = (9 + turn_offset) * tile_h;
+                                break;
+
+                            case FT_ELECTRON:
+                                break;
+
+                            default:
+                                break;
+                        }
+                    }
+
+                    else if (field.has_hint(HINT_FROM_RIGHT)
+                            || (field.type == FT_MURPHY && last_murphy_side_move == DIR_LEFT &&
+                                field.has_hint(HINT_FROM_TOP | HINT_FROM_BOTTOM)))
+                    {
+                        source.x = animation_frame * tile_w;
+
+                        switch (field.type) {
+                            case FT_MURPHY:
+								if (!field.has_hint(HINT_PUSH)) {
+									source.y = 0 * tile_h;
+								}
+								else {
+									source.x = 1 * tile_w;
+									source.y = 20 * tile_h;
+								}
+                                break;
+
+                            case FT_ZONK:
+                                source.y = 2 * tile_h;
+                                break;
+
+                            case FT_INFOTRON:
+                                source.y = 4 * tile_h;
+                                break;
+
+                            case FT_SNIK_SNAK:
+                                source.y = (8 + turn_offset) * tile_h;
+                                break;
+
+                            default:
+                                break;
+                        }
+                    }
+
+                    else if (field.has_hint(HINT_FROM_TOP)) {
+                        source.x = animation_frame * tile_w;
+
+                        switch (field.type) {
+                            case FT_SNIK_SNAK:
+                                source.y = (11 + turn_offset) * tile_h;
+                                break;
+
+                            default:
+                                break;
+                        }
+                    }
+
+                    else if (field.has_hint(HINT_FROM_BOTTOM)) {
+                        source.x = animation_frame * tile_w;
+
+                        switch (field.type) {
+                            case FT_SNIK_SNAK:
+                                source.y = (10 + turn_offset) * tile_h;
+                                break;
+
+                            default:
+                                break;
+                        }
+                    }
+                }
+
+                if (need_draw) {
+                    SDL_BlitSurface(source_surface, &source, screen, &dest);
+                    band.animated = true;
+                }
+            }
+        }
+    }
+
+
+    /**
+     * Center the camera on Murphy, as he is drawn with given move offset, but do not scroll past the level edges.
+     * Level smaller than the window is centered.
+     */
+    void update_camera(Level *level, SDL_Surface *screen, int move_offset) {
+        int tile_w = FIELD_WIDTH * scale;
+        int tile_h = FIELD_HEIGHT * scale;
+
+        Point murphy = level->murphy_position();
+        const Field &field = level->field(murphy.x, murphy.y);
+
+        int x = murphy.x * tile_w;
+        int y = murphy.y * tile_h;
+        int slide = tile_h - move_offset;
+
+        if (field.type == FT_MURPHY && !(field.hint & (HINT_TURN_LEFT | HINT_TURN_RIGHT))) {
+            if (field.hint & HINT_FROM_TOP) {
+                y -= slide;
+            } else if (field.hint & HINT_FROM_BOTTOM) {
+                y += slide;
+            } else if (field.hint & HINT_FROM_LEFT) {
+                x -= slide;
+            } else if (field.hint & HINT_FROM_RIGHT) {
+                x += slide;
+            }
+        }
+
+        camera_x = follow(x + tile_w / 2, screen->w, level->width() * tile_w);
+        camera_y = follow(y + tile_h / 2, screen->h, level->height() * tile_h);
+    }
+
+    static int follow(int target, int view, int size) {
+        if (size <= view) {
+            return (size - view) / 2;
+        }
+
+        return std::max(0, std::min(size - view, target - view / 2));
+    }
+
+    /**
+     * Make sure the atlases match the window surface format and the integer scale that fits the window.
+     */
+    void prepare_atlas(SDL_Surface *screen) {
+        int new_scale = std::max(1, std::min(screen->w / (FIELD_WIDTH * Level::LEVEL_WIDTH),
+            screen->h / (FIELD_HEIGHT * Level::LEVEL_HEIGHT)));
+
+        if (fixed && new_scale == scale && fixed->format->format == screen->format->format) {
+            return;
+        }
+
+        if (fixed_native->format->format != screen->format->format) {
+            // Window has been moved to display with different format.
+            SDL_Surface *converted = SDL_ConvertSurface(fixed_native, screen->format, 0);
+            SDL_FreeSurface(fixed_native);
+            fixed_native = converted;
+
+            converted = SDL_ConvertSurface(moving_native, screen->format, 0);
+            SDL_FreeSurface(moving_native);
+            moving_native = converted;
+        }
+
+        // Bands blit from their own views of the old sprites.
+        free_bands();
+
+        SDL_FreeSurface(fixed);
+        SDL_FreeSurface(moving);
+
+        scale = new_scale;
+        fixed = scale_surface(fixed_native, scale);
+        moving = scale_surface(moving_native, scale);
+    }
+
+    /**
+     * Nearest neighbour integer upscale, so the sprites stay pixel exact.
+     */
+    static SDL_Surface *scale_surface(SDL_Surface *src, int factor) {
+        SDL_Surface *dst = SDL_CreateRGBSurfaceWithFormat(0, src->w * factor, src->h * factor,
+            src->format->BitsPerPixel, src->format->format);
+
+        int bpp = src->format->BytesPerPixel;
+
+        SDL_LockSurface(src);
+        SDL_LockSurface(dst);
+
+        for (int y = 0; y < dst->h; ++y) {
+            const uint8_t *src_row = (const uint8_t *)src->pixels + (y / factor) * src->pitch;
+            uint8_t *dst_row = (uint8_t *)dst->pixels + y * dst->pitch;
+
+            for (int x = 0; x < dst->w; ++x) {
+                memcpy(dst_row + x * bpp, src_row + (x / factor) * bpp, bpp);
+            }
+        }
+
+        SDL_UnlockSurface(dst);
+        SDL_UnlockSurface(src);
+
+        return dst;
+    }
+
+    /**
+     * Load sprites and convert them to given pixel format, either from the atlas cache or from the bitmaps.
+     */
+    void load_atlas(const SDL_PixelFormat *format) {
+        AtlasCacheHeader key;
+        memset(&key, 0, sizeof(key));
+        key.magic = ATLAS_CACHE_MAGIC;
+        key.pixel_format = format->format;
+        key.bytes_per_pixel = format->BytesPerPixel;
+        file_stamp(FIXED_FILE, key.fixed_size, key.fixed_mtime);
+        file_stamp(MOVING_FILE, key.moving_size, key.moving_mtime);
+
+        if (atlas_cache && read_atlas_cache(key)) {
+            return;
+        }
+
+        SDL_Surface *loaded = SDL_LoadBMP(FIXED_FILE);
+        if (!loaded) {
+            fprintf(stderr, "Unable to load %s: %s\n", FIXED_FILE, SDL_GetError());
+            exit(EXIT_FAILURE);
+        }
+
+        fixed_native = SDL_ConvertSurface(loaded, format, 0);
+        SDL_FreeSurface(loaded);
+
+        loaded = SDL_LoadBMP(MOVING_FILE);
+        if (!loaded) {
+            fprintf(stderr, "Unable to load %s: %s\n", MOVING_FILE, SDL_GetError());
+            exit(EXIT_FAILURE);
+        }
+
+        moving_native = SDL_ConvertSurface(loaded, format, 0);
+        SDL_FreeSurface(loaded);
+
+        if (atlas_cache) {
+            write_atlas_cache(key);
+        }
+    }
+
+    bool read_atlas_cache(const AtlasCacheHeader &key) {
+        FILE *f = fopen(atlas_cache, "rb");
+        if (!f) {
+            return false;
+        }
+
+        AtlasCacheHeader header;
+        bool ok = fread(&header, sizeof(header), 1, f) == 1
+            && memcmp(&header, &key, offsetof(AtlasCacheHeader, fixed_w)) == 0;
+
+        if (ok) {
+            fixed_native = read_surface(f, header.fixed_w, header.fixed_h, key);
+            moving_native = read_surface(f, header.moving_w, header.moving_h, key);
+            ok = fixed_native && moving_native;
+
+            if (!ok) {
+                SDL_FreeSurface(fixed_native);
+                SDL_FreeSurface(moving_native);
+                fixed_native = moving_native = nullptr;
+            }
+        }
+
+        fclose(f);
+        return ok;
+    }
+
+    static SDL_Surface *read_surface(FILE *f, int w, int h, const AtlasCacheHeader &key) {
+        SDL_Surface *surface = SDL_CreateRGBSurfaceWithFormat(0, w, h, key.bytes_per_pixel * 8, key.pixel_format);
+        if (!surface) {
+            return nullptr;
+        }
+
+        for (int y = 0; y < h; ++y) {
+            if (fread((uint8_t *)surface->pixels + y * surface->pitch, key.bytes_per_pixel, w, f) != (size_t)w) {
+                SDL_FreeSurface(surface);
+                return nullptr;
+            }
+        }
+
+        return surface;
+    }
+
+    void write_atlas_cache(AtlasCacheHeader header) {
+        FILE *f = fopen(atlas_cache, "wb");
+        if (!f) {
+            return;
+        }
+
+        header.fixed_w = fixed_native->w;
+        header.fixed_h = fixed_native->h;
+        header.moving_w = moving_native->w;
+        header.moving_h = moving_native->h;
+
+        bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+
+        for (SDL_Surface *surface : {fixed_native, moving_native}) {
+            SDL_LockSurface(surface);
+            for (int y = 0; ok && y < surface->h; ++y) {
+                ok = fwrite((uint8_t *)surface->pixels + y * surface->pitch, header.bytes_per_pixel, surface->w, f)
+                    == (size_t)surface->w;
+            }
+            SDL_UnlockSurface(surface);
+        }
+
+        if (fclose(f) != 0 || !ok) {
+            remove(atlas_cache);
+        }
+    }
+
+    /**
+     * Input is handled between game steps, so quick save is always at animation frame 0.
+     */
+    void quick_save(Level *level) {
+        SaveState *state = new SaveState;
+        level->save_state(*state);
+        save_state(*state);
+        state->animation_frame = 0;
+        state->seal();
+
+        if (!state->write(QUICK_SAVE_FILE)) {
+            fprintf(stderr, "Unable to write %s.\n", QUICK_SAVE_FILE);
+        }
+
+        delete state;
+    }
+
+    void show_speed() {
+        char title[32];
+        if (turbo) {
+            snprintf(title, sizeof(title), "Supaplex - turbo %dx", turbo_speed);
+        } else {
+            snprintf(title, sizeof(title), "Supaplex");
+        }
+
+        SDL_SetWindowTitle(window, title);
+    }
+
+    void quick_load(Level *level) {
+        SaveStateFile file(QUICK_SAVE_FILE);
+        if (file.state()) {
+            level->load_state(*file.state());
+            load_state(*file.state());
+            dirty = true;
+        } else {
+            fprintf(stderr, "%s is missing or invalid.\n", QUICK_SAVE_FILE);
+        }
+    }
+
+    bool has_animation(Field field) {
+        if (field.has_hint(HINT_EXPLOSION)
+            || field.has_hint(HINT_FROM_LEFT | HINT_FROM_RIGHT | HINT_FROM_TOP | HINT_FROM_BOTTOM))
+        {
+            return true;
+        }
+
+        return false;
+    }
+};
+
+/**
+ * Window showing many games at once as a grid of thumbnails, for watching a batch of bots. Thumbnails show field
+ * types only, without sliding and animations, and every frame copies just the tiles whose type has changed since
+ * the previous frame. Thumbnails are split between worker threads, the window is presented once per frame.
+ */
+class MosaicDrawer {
+public:
+    MosaicDrawer(int games): games(games), columns(1), tile(0), width(0), height(0), format(0), atlas(nullptr),
+        screen(nullptr), types(nullptr), generation(0), pending(0), quit(false)
+    {
+        SDL_Init(SDL_INIT_VIDEO);
+        window = SDL_CreateWindow("Supaplex", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, 1280, 720, SDL_WINDOW_RESIZABLE);
+
+        SDL_Surface *loaded = SDL_LoadBMP(SDLDrawer::FIXED_FILE);
+        if (!loaded) {
+            fprintf(stderr, "Unable to load %s: %s\n", SDLDrawer::FIXED_FILE, SDL_GetError());
+            exit(EXIT_FAILURE);
+        }
+
+        sprites = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+        SDL_FreeSurface(loaded);
+
+        shown.resize((size_t)games * FIELDS);
+
+        int threads = std::max(1, std::min(games, (int)std::thread::hardware_concurrency()));
+        for (int i = 1; i < threads; ++i) {
+            workers.emplace_back(&MosaicDrawer::work, this, i);
+        }
+    }
+
+    ~MosaicDrawer() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = true;
+        }
+
+        wake.notify_all();
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        SDL_FreeSurface(atlas);
+        SDL_FreeSurface(sprites);
+
+        SDL_DestroyWindow(window);
+        SDL_Quit();
+    }
+
+    MosaicDrawer(const MosaicDrawer &) = delete;
+    MosaicDrawer &operator=(const MosaicDrawer &) = delete;
+
+    /**
+     * Return false when the window has been closed.
+     */
+    bool handle_input() {
+        SDL_Event event;
+        while (SDL_PollEvent(&event)) {
+            if (event.type == SDL_QUIT || (event.type == SDL_KEYDOWN && event.key.keysym.sym == SDLK_ESCAPE)) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    /**
+     * Draw field types of all games, laid out as BatchEnv::observations().
+     */
+    void draw(const uint8_t *types) {
+        SDL_Surface *surface = SDL_GetWindowSurface(window);
+        layout(surface);
+
+        if (SDL_MUSTLOCK(surface)) {
+            SDL_LockSurface(surface);
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            screen = surface;
+            this->types = types;
+            pending = workers.size();
+            ++generation;
+        }
+
+        wake.notify_all();
+        draw_part(0);
+
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            done.wait(lock, [this]() { return pending == 0; });
+        }
+
+        if (SDL_MUSTLOCK(surface)) {
+            SDL_UnlockSurface(surface);
+        }
+
+        SDL_UpdateWindowSurface(window);
+    }
+
+    int refresh_rate() {
+        SDL_DisplayMode mode;
+        if (SDL_GetWindowDisplayMode(window, &mode) == 0) {
+            return mode.refresh_rate;
+        }
+
+        return 0;
+    }
+
+    /**
+     * First row of ARGB8888 sprites (one for every field type) scaled down to size x size, each pixel is the average
+     * of the sprite pixels it covers.
+     */
+    static SDL_Surface *scale_sprites(SDL_Surface *sprites, int size) {
+        const int fw = SDLDrawer::FIELD_WIDTH;
+        const int fh = SDLDrawer::FIELD_HEIGHT;
+        int count = sprites->w / fw;
+
+        SDL_Surface *scaled = SDL_CreateRGBSurfaceWithFormat(0, count * size, size, 32, SDL_PIXELFORMAT_ARGB8888);
+
+        SDL_LockSurface(sprites);
+        SDL_LockSurface(scaled);
+
+        for (int sprite = 0; sprite < count; ++sprite) {
+            for (int ty = 0; ty < size; ++ty) {
+                for (int tx = 0; tx < size; ++tx) {
+                    uint32_t sum[4] = { 0, 0, 0, 0 };
+                    int pixels = 0;
+
+                    for (int y = ty * fh / size; y < (ty + 1) * fh / size; ++y) {
+                        const uint32_t *row = (const uint32_t *)((const uint8_t *)sprites->pixels + y * sprites->pitch);
+
+                        for (int x = tx * fw / size; x < (tx + 1) * fw / size; ++x) {
+                            uint32_t pixel = row[sprite * fw + x];
+                            for (int c = 0; c < 4; ++c) {
+                                sum[c] += (pixel >> (c * 8)) & 0xff;
+                            }
+                            ++pixels;
+                        }
+                    }
+
+                    uint32_t average = 0;
+                    for (int c = 0; c < 4; ++c) {
+                        average |= (sum[c] / pixels) << (c * 8);
+                    }
+
+                    uint32_t *row = (uint32_t *)((uint8_t *)scaled->pixels + ty * scaled->pitch);
+                    row[sprite * size + tx] = average;
+                }
+            }
+        }
+
+        SDL_UnlockSurface(scaled);
+        SDL_UnlockSurface(sprites);
+
+        return scaled;
+    }
+
+protected:
+    static const int FIELDS = Level::LEVEL_WIDTH * Level::LEVEL_HEIGHT;
+    static const int GAP = 2; /**< Pixels between thumbnails. */
+    static const uint8_t NOT_SHOWN = 0xff;
+
+    int games;
+    int columns;
+    int tile;   /**< Size of one field in the thumbnails, in pixels. */
+    int width;  /**< Window size and format the layout has been made for. */
+    int height;
+    uint32_t format;
+
+    SDL_Window *window;
+    SDL_Surface *sprites; /**< Field sprites, ARGB8888. */
+    SDL_Surface *atlas;   /**< Field sprites scaled down to tile size, in window pixel format. */
+    std::vector<uint8_t> shown; /**< Field types shown in every thumbnail. */
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake;
+    std::condition_variable done;
+    SDL_Surface *screen;
+    const uint8_t *types;
+    uint64_t generation; /**< Number of frames handed to workers. */
+    size_t pending;      /**< Workers that have not finished the current frame yet. */
+    bool quit;
+
+    void work(int part) {
+        std::unique_lock<std::mutex> lock(mutex);
+        uint64_t drawn = 0;
+
+        while (true) {
+            wake.wait(lock, [&]() { return generation != drawn || quit; });
+            if (quit) {
+                return;
+            }
+
+            drawn = generation;
+
+            lock.unlock();
+            draw_part(part);
+            lock.lock();
+
+            if (--pending == 0) {
+                done.notify_one();
+            }
+        }
+    }
+
+    /**
+     * Draw changed tiles of the thumbnails that belong to given part, part 0 is drawn by the calling thread.
+     */
+    void draw_part(int part) {
+        int parts = workers.size() + 1;
+        int first = (int64_t)games * part / parts;
+        int last = (int64_t)games * (part + 1) / parts;
+
+        int bpp = screen->format->BytesPerPixel;
+        int atlas_types = atlas->w / tile;
+        int thumb_w = Level::LEVEL_WIDTH * tile;
+        int thumb_h = Level::LEVEL_HEIGHT * tile;
+
+        for (int game = first; game < last; ++game) {
+            const uint8_t *now = types + (size_t)game * FIELDS;
+            uint8_t *old = &shown[(size_t)game * FIELDS];
+
+            int left = GAP + (game % columns) * (thumb_w + GAP);
+            int top = GAP + (game / columns) * (thumb_h + GAP);
+
+            for (int i = 0; i < FIELDS; ++i) {
+                if (now[i] == old[i]) {
+                    continue;
+                }
+
+                int x = left + (i % Level::LEVEL_WIDTH) * tile;
+                int y = top + (i / Level::LEVEL_WIDTH) * tile;
+                if (x + tile > screen->w || y + tile > screen->h) {
+                    continue;
+                }
+
+                old[i] = now[i];
+                int sprite = now[i] < atlas_types ? now[i] : (int)FT_EMPTY;
+
+                const uint8_t *src = (const uint8_t *)atlas->pixels + sprite * tile * bpp;
+                uint8_t *dst = (uint8_t *)screen->pixels + y * screen->pitch + x * bpp;
+
+                for (int row = 0; row < tile; ++row) {
+                    memcpy(dst + row * screen->pitch, src + row * atlas->pitch, tile * bpp);
+                }
+            }
+        }
+    }
+
+    /**
+     * Choose the number of columns that gives the largest thumbnails, and scale the sprites for them. Everything is
+     * redrawn after the window has been resized.
+     */
+    void layout(SDL_Surface *surface) {
+        if (atlas && surface->w == width && surface->h == height && surface->format->format == format) {
+            return;
+        }
+
+        width = surface->w;
+        height = surface->h;
+        format = surface->format->format;
+
+        int best = 0;
+        for (int cols = 1; cols <= games; ++cols) {
+            int rows = (games + cols - 1) / cols;
+            int size = std::min(((width - GAP) / cols - GAP) / Level::LEVEL_WIDTH,
+                ((height - GAP) / rows - GAP) / Level::LEVEL_HEIGHT);
+
+            if (size > best) {
+                best = size;
+                columns = cols;
+            }
+        }
+
+        tile = std::max(1, std::min(best, (int)SDLDrawer::FIELD_WIDTH));
+
+        SDL_Surface *scaled = scale_sprites(sprites, tile);
+        SDL_FreeSurface(atlas);
+        atlas = SDL_ConvertSurface(scaled, surface->format, 0);
+        SDL_FreeSurface(scaled);
+
+        SDL_FillRect(surface, nullptr, SDL_MapRGB(surface->format, 32, 32, 32));
+        std::fill(shown.begin(), shown.end(), NOT_SHOWN);
+    }
+};
+
+/**
+ * Titles, flags, object counts and thumbnails of all levels in the level file, for the level select screen.
+ * Thumbnails are rendered by worker threads, the result is cached in a file keyed by the checksum of the level file
+ * and the stamp of the sprites, so later starts only read the cache.
+ */
+class LevelIndex {
+public:
+    static const int TILE = 2; /**< Size of one field in thumbnails, in pixels. */
+    static const int THUMB_WIDTH = Level::LEVEL_WIDTH * TILE;
+    static const int THUMB_HEIGHT = Level::LEVEL_HEIGHT * TILE;
+
+    struct Entry {
+        char title[Level::LEVEL_NAME_LENGTH + 1];
+        uint8_t gravitation;
+        uint8_t freeze_zonks;
+        uint16_t infotrons;
+        uint16_t zonks;
+        uint16_t snik_snaks;
+        uint16_t electrons;
+        uint16_t disks;    /**< Red, orange and yellow disks. */
+        uint16_t reserved;
+    };
+
+    LevelIndex(): cached(false) {}
+
+    /**
+     * Read the index from cache_file, or build it and write the cache. Return false when there are no levels.
+     */
+    bool open(const char *levels_file, const char *cache_file) {
+        CacheHeader key;
+        memset(&key, 0, sizeof(key));
+        key.magic = CACHE_MAGIC;
+        key.version = CACHE_VERSION;
+        key.tile = TILE;
+        key.levels_checksum = file_checksum(levels_file, key.levels_size);
+        SDLDrawer::file_stamp(SDLDrawer::FIXED_FILE, key.fixed_size, key.fixed_mtime);
+
+        key.count = key.levels_size / Level::LEVEL_BYTES;
+        if (key.count == 0) {
+            return false;
+        }
+
+        cached = cache_file && read_cache(cache_file, key);
+        if (!cached) {
+            build(levels_file, key.count);
+
+            if (cache_file) {
+                write_cache(cache_file, key);
+            }
+        }
+
+        return true;
+    }
+
+    int count() const {
+        return entries.size();
+    }
+
+    /**
+     * Entry of given level, 1-based as in the level file.
+     */
+    const Entry &entry(int level) const {
+        return entries[level - 1];
+    }
+
+    /**
+     * Thumbnail of given level, THUMB_WIDTH x THUMB_HEIGHT ARGB8888 pixels. Thumbnails follow each other, so all of
+     * them form one image THUMB_HEIGHT * count() pixels high.
+     */
+    const uint32_t *thumbnail(int level) const {
+        return &pixels[(size_t)(level - 1) * THUMB_WIDTH * THUMB_HEIGHT];
+    }
+
+    /**
+     * True when the index has been read from the cache.
+     */
+    bool from_cache() const {
+        return cached;
+    }
+
+protected:
+    static const uint32_t CACHE_MAGIC = 0x5844494c; /**< "LIDX" */
+    static const uint32_t CACHE_VERSION = 1;
+
+    struct CacheHeader {
+        uint32_t magic;
+        uint32_t version;
+        uint32_t levels_checksum;
+        int32_t count;
+        int64_t levels_size;
+        int64_t fixed_size;
+        int64_t fixed_mtime;
+        int32_t tile;
+        int32_t reserved;
+    };
+
+    bool cached;
+    std::vector<Entry> entries;
+    std::vector<uint32_t> pixels;
+
+    /**
+     * FNV-1a of the whole file.
+     */
+    static uint32_t file_checksum(const char *file_name, int64_t &size) {
+        uint32_t hash = 2166136261u;
+        size = 0;
+
+        FILE *f = fopen(file_name, "rb");
+        if (!f) {
+            return hash;
+        }
+
+        uint8_t buffer[16384];
+        size_t len;
+        while ((len = fread(buffer, 1, sizeof(buffer), f)) > 0) {
+            for (size_t i = 0; i < len; ++i) {
+                hash = (hash ^ buffer[i]) * 16777619u;
+            }
+            size += len;
+        }
+
+        fclose(f);
+        return hash;
+    }
+
+    void build(const char *levels_file, int count) {
+        entries.assign(count, Entry());
+        pixels.assign((size_t)count * THUMB_WIDTH * THUMB_HEIGHT, 0);
+
+        SDL_Surface *tiles = nullptr;
+        SDL_Surface *loaded = SDL_LoadBMP(SDLDrawer::FIXED_FILE);
+        if (loaded) {
+            SDL_Surface *sprites = SDL_ConvertSurfaceFormat(loaded, SDL_PIXELFORMAT_ARGB8888, 0);
+            tiles = MosaicDrawer::scale_sprites(sprites, TILE);
+            SDL_FreeSurface(sprites);
+            SDL_FreeSurface(loaded);
+        } else {
+            fprintf(stderr, "Unable to load %s: %s, thumbnails will be empty.\n", SDLDrawer::FIXED_FILE, SDL_GetError());
+        }
+
+        int threads = std::max(1, std::min(count, (int)std::thread::hardware_concurrency()));
+        std::vector<std::thread> workers;
+
+        for (int part = 1; part < threads; ++part) {
+            workers.emplace_back([=]() {
+                for (int level = part + 1; level <= count; level += threads) {
+                    render(levels_file, level, tiles);
+                }
+            });
+        }
+
+        for (int level = 1; level <= count; level += threads) {
+            render(levels_file, level, tiles);
+        }
+
+        for (std::thread &worker : workers) {
+            worker.join();
+        }
+
+        SDL_FreeSurface(tiles);
+    }
+
+    /**
+     * Fill in the entry and thumbnail of one level. Levels are independent, so they can be rendered concurrently.
+     */
+    void render(const char *levels_file, int level_no, const SDL_Surface *tiles) {
+        Level level(levels_file, level_no);
+        Entry &e = entries[level_no - 1];
+
+        memcpy(e.title, level.title, Level::LEVEL_NAME_LENGTH);
+        e.gravitation = level.gravitation;
+        e.freeze_zonks = level.freeze_zonks;
+
+        uint32_t *thumb = &pixels[(size_t)(level_no - 1) * THUMB_WIDTH * THUMB_HEIGHT];
+        int tile_types = tiles ? tiles->w / TILE : 0;
+
+        for (int y = 0; y < level.height(); ++y) {
+            for (int x = 0; x < level.width(); ++x) {
+                FieldType type = level.field(x, y).type;
+
+                switch (type) {
+                    case FT_INFOTRON: ++e.infotrons; break;
+                    case FT_ZONK: ++e.zonks; break;
+                    case FT_SNIK_SNAK: ++e.snik_snaks; break;
+                    case FT_ELECTRON: ++e.electrons; break;
+                    case FT_RED_DISK: case FT_ORANGE_DISK: case FT_YELLOW_DISK: ++e.disks; break;
+                    default: break;
+                }
+
+                if (type >= tile_types) {
+                    continue;
+                }
+
+                for (int row = 0; row < TILE; ++row) {
+                    const uint32_t *src = (const uint32_t *)((const uint8_t *)tiles->pixels + row * tiles->pitch);
+                    memcpy(&thumb[(y * TILE + row) * THUMB_WIDTH + x * TILE], &src[type * TILE], TILE * sizeof(uint32_t));
+                }
+            }
+        }
+    }
+
+    bool read_cache(const char *cache_file, const CacheHeader &key) {
+        FILE *f = fopen(cache_file, "rb");
+        if (!f) {
+            return false;
+        }
+
+        CacheHeader header;
+        bool ok = fread(&header, sizeof(header), 1, f) == 1 && memcmp(&header, &key, sizeof(header)) == 0;
+
+        if (ok) {
+            entries.resize(key.count);
+            pixels.resize((size_t)key.count * THUMB_WIDTH * THUMB_HEIGHT);
+
+            ok = fread(entries.data(), sizeof(Entry), entries.size(), f) == entries.size()
+                && fread(pixels.data(), sizeof(uint32_t), pixels.size(), f) == pixels.size();
+        }
+
+        fclose(f);
+
+        if (!ok) {
+            entries.clear();
+            pixels.clear();
+        }
+
+        return ok;
+    }
+
+    void write_cache(const char *cache_file, const CacheHeader &key) {
+        FILE *f = fopen(cache_file, "wb");
+        if (!f) {
+            return;
+        }
+
+        bool ok = fwrite(&key, sizeof(key), 1, f) == 1
+            && fwrite(entries.data(), sizeof(Entry), entries.size(), f) == entries.size()
+            && fwrite(pixels.data(), sizeof(uint32_t), pixels.size(), f) == pixels.size();
+
+        if (fclose(f) != 0 || !ok) {
+            remove(cache_file);
+        }
+    }
+};
+
+static_assert(sizeof(LevelIndex::Entry) == 38, "LevelIndex::Entry must not be padded.");
+
+/**
+ * Window with thumbnails of all levels. Arrows move the selection, title, flags and object counts of the selected
+ * level are shown in the window title, Enter starts the selected level.
+ */
+class LevelSelect {
+public:
+    LevelSelect(const LevelIndex &index): index(index), top_row(0) {
+        SDL_Init(SDL_INIT_VIDEO);
+        window = SDL_CreateWindow("Supaplex", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED,
+            10 * (LevelIndex::THUMB_WIDTH + GAP) + GAP, 6 * (LevelIndex::THUMB_HEIGHT + GAP) + GAP, SDL_WINDOW_RESIZABLE);
+
+        // All thumbnails form one image, converted to the window format once.
+        SDL_Surface *all = SDL_CreateRGBSurfaceWithFormatFrom((void *)index.thumbnail(1), LevelIndex::THUMB_WIDTH,
+            LevelIndex::THUMB_HEIGHT * index.count(), 32, LevelIndex::THUMB_WIDTH * sizeof(uint32_t),
+            SDL_PIXELFORMAT_ARGB8888);
+        thumbnails = SDL_ConvertSurface(all, SDL_GetWindowSurface(window)->format, 0);
+        SDL_FreeSurface(all);
+    }
+
+    ~LevelSelect() {
+        SDL_FreeSurface(thumbnails);
+        SDL_DestroyWindow(window);
+    }
+
+    LevelSelect(const LevelSelect &) = delete;
+    LevelSelect &operator=(const LevelSelect &) = delete;
+
+    /**
+     * Let the player choose a level, starting with selected one. Return its number, 0 when the window was closed.
+     */
+    int run(int selected) {
+        selected = std::max(1, std::min(index.count(), selected));
+        bool dirty = true;
+
+        while (true) {
+            if (dirty) {
+                draw(selected);
+                dirty = false;
+            }
+
+            SDL_Event event;
+            if (!SDL_WaitEventTimeout(&event, 100)) {
+                continue;
+            }
+
+            if (event.type == SDL_QUIT) {
+                return 0;
+            }
+
+            if (event.type == SDL_WINDOWEVENT) {
+                dirty = true;
+            }
+
+            if (event.type != SDL_KEYDOWN) {
+                continue;
+            }
+
+            int columns = columns_shown();
+            int moved = selected;
+
+            switch (event.key.keysym.sym) {
+                case SDLK_ESCAPE: return 0;
+                case SDLK_RETURN: return selected;
+                case SDLK_LEFT: moved = selected - 1; break;
+                case SDLK_RIGHT: moved = selected + 1; break;
+                case SDLK_UP: moved = selected - columns; break;
+                case SDLK_DOWN: moved = selected + columns; break;
+                case SDLK_PAGEUP: moved = selected - columns * std::max(1, rows_shown() - 1); break;
+                case SDLK_PAGEDOWN: moved = selected + columns * std::max(1, rows_shown() - 1); break;
+                case SDLK_HOME: moved = 1; break;
+                case SDLK_END: moved = index.count(); break;
+                default: break;
+            }
+
+            moved = std::max(1, std::min(index.count(), moved));
+            if (moved != selected) {
+                selected = moved;
+                dirty = true;
+            }
+        }
+    }
+
+protected:
+    static const int GAP = 4; /**< Pixels between thumbnails, the selection frame is drawn there. */
+
+    const LevelIndex &index;
+    SDL_Window *window;
+    SDL_Surface *thumbnails;
+    int top_row; /**< First row of thumbnails shown, the view scrolls to keep the selection visible. */
+
+    int columns_shown() {
+        return std::max(1, (SDL_GetWindowSurface(window)->w - GAP) / (LevelIndex::THUMB_WIDTH + GAP));
+    }
+
+    int rows_shown() {
+        return std::max(1, (SDL_GetWindowSurface(window)->h - GAP) / (LevelIndex::THUMB_HEIGHT + GAP));
+    }
+
+    void draw(int selected) {
+        SDL_Surface *screen = SDL_GetWindowSurface(window);
+        int columns = columns_shown();
+        int rows = rows_shown();
+
+        int row = (selected - 1) / columns;
+        if (row < top_row) {
+            top_row = row;
+        } else if (row >= top_row + rows) {
+            top_row = row - rows + 1;
+        }
+
+        SDL_FillRect(screen, nullptr, SDL_MapRGB(screen->format, 32, 32, 32));
+
+        for (int level = top_row * columns + 1; level <= std::min(index.count(), (top_row + rows) * columns); ++level) {
+            SDL_Rect dest;
+            dest.x = GAP + ((level - 1) % columns) * (LevelIndex::THUMB_WIDTH + GAP);
+            dest.y = GAP + ((level - 1) / columns - top_row) * (LevelIndex::THUMB_HEIGHT + GAP);
+            dest.w = LevelIndex::THUMB_WIDTH;
+            dest.h = LevelIndex::THUMB_HEIGHT;
+
+            if (level == selected) {
+                SDL_Rect frame = dest;
+                frame.x -= GAP / 2;
+                frame.y -= GAP / 2;
+                frame.w += GAP;
+                frame.h += GAP;
+                SDL_FillRect(screen, &frame, SDL_MapRGB(screen->format, 255, 255, 0));
+            }
+
+            SDL_Rect source;
+            source.x = 0;
+            source.y = (level - 1) * LevelIndex::THUMB_HEIGHT;
+            source.w = LevelIndex::THUMB_WIDTH;
+            source.h = LevelIndex::THUMB_HEIGHT;
+
+            SDL_BlitSurface(thumbnails, &source, screen, &dest);
+        }
+
+        SDL_UpdateWindowSurface(window);
+
+        const LevelIndex::Entry &e = index.entry(selected);
+        char title[256];
+        snprintf(title, sizeof(title), "Supaplex - %03d %s%s%s - %d infotrons, %d zonks, %d snik snaks, %d electrons, "
+            "%d disks", selected, e.title, e.gravitation ? " [gravity]" : "", e.freeze_zonks ? " [frozen zonks]" : "",
+            e.infotrons, e.zonks, e.snik_snaks, e.electrons, e.disks);
+        SDL_SetWindowTitle(window, title);
+    }
+};
+
+#ifndef _WIN32
+/**
+ * Interface for terminals, for watching and playing games over SSH. Every field is one character (or a colour block),
+ * each frame writes only escape sequences for the fields that changed since the previous one, in a single write().
+ * Sprites do not slide, so the screen changes only with game steps.
+ */
+class TerminalDrawer: public Drawer {
+public:
+    /**
+     * blocks draws fields as two columns wide colour blocks instead of coloured characters.
+     */
+    TerminalDrawer(bool blocks): blocks(blocks), turbo(false), turbo_speed(8), escape_length(0), rows(0), columns(0),
+        cursor_row(-1), cursor_column(-1), color(-1), drawn_step(-1)
+    {
+        tcgetattr(STDIN_FILENO, &saved_termios);
+
+        termios raw = saved_termios;
+        raw.c_lflag &= ~(ICANON | ECHO | ISIG);
+        raw.c_cc[VMIN] = 0;
+        raw.c_cc[VTIME] = 0;
+
+        // Killed or crashed game must not leave the terminal raw.
+        restore_termios = saved_termios;
+        for (size_t i = 0; i < sizeof(RESTORE_SIGNALS) / sizeof(RESTORE_SIGNALS[0]); ++i) {
+            previous_handlers[i] = signal(RESTORE_SIGNALS[i], restore_handler);
+            if (previous_handlers[i] == SIG_IGN) {
+                signal(RESTORE_SIGNALS[i], SIG_IGN);
+            }
+        }
+
+        tcsetattr(STDIN_FILENO, TCSANOW, &raw);
+
+        out.reserve(64 * 1024);
+
+        // Alternate screen, hidden cursor.
+        out = "\x1b[?1049h\x1b[?25l";
+        flush();
+    }
+
+    ~TerminalDrawer() {
+        out = "\x1b[0m\x1b[?25h\x1b[?1049l";
+        flush();
+
+        tcsetattr(STDIN_FILENO, TCSANOW, &saved_termios);
+
+        for (size_t i = 0; i < sizeof(RESTORE_SIGNALS) / sizeof(RESTORE_SIGNALS[0]); ++i) {
+            signal(RESTORE_SIGNALS[i], previous_handlers[i]);
+        }
+    }
+
+    bool handle_input(Level *level) {
+        GameEvent move = EVENT_MOVE_NONE;
+        bool special = false;
+
+        unsigned char buf[256];
+        ssize_t len;
+        std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+
+        while ((len = read(STDIN_FILENO, buf, sizeof(buf))) > 0) {
+            for (ssize_t i = 0; i < len; ++i) {
+                // Arrows are ESC [ A..D (or ESC O A..D). The sequence may be split between reads, so its beginning
+                // is kept for the next one.
+                if (escape_length == 1 && (buf[i] == '[' || buf[i] == 'O')) {
+                    escape_length = 2;
+                    continue;
+                }
+
+                if (escape_length == 2) {
+                    switch (buf[i]) {
+                        case 'A': move = EVENT_MOVE_UP; break;
+                        case 'B': move = EVENT_MOVE_DOWN; break;
+                        case 'C': move = EVENT_MOVE_RIGHT; break;
+                        case 'D': move = EVENT_MOVE_LEFT; break;
+                        default: break;
+                    }
+                    escape_length = 0;
+                    continue;
+                }
+
+                if (escape_length == 1) {
+                    // ESC followed by anything else is a lone ESC, the byte is a key of its own.
+                    escape_length = 0;
+                    level->dispatch_event(EVENT_END_GAME);
+                }
+
+                switch (buf[i]) {
+                    case 0x1b:
+                        escape_length = 1;
+                        escape_start = now;
+                        break;
+
+                    case 'w': move = EVENT_MOVE_UP; break;
+                    case 's': move = EVENT_MOVE_DOWN; break;
+                    case 'a': move = EVENT_MOVE_LEFT; break;
+                    case 'd': move = EVENT_MOVE_RIGHT; break;
+                    case ' ': special = true; break;
+
+                    case 't': turbo = !turbo; break;
+                    case '+': turbo_speed = std::min(MAX_TURBO_SPEED, turbo_speed * 2); break;
+                    case '-': turbo_speed = std::max(2, turbo_speed / 2); break;
+
+                    case 'q':
+                    case 0x03: // Ctrl+C
+                        return false;
+
+                    default:
+                        break;
+                }
+            }
+        }
+
+        // Lone ESC ends the game once nothing has followed it for a while, unfinished sequences are dropped.
+        if (escape_length > 0 && now - escape_start >= ESCAPE_TIMEOUT) {
+            if (escape_length == 1) {
+                level->dispatch_event(EVENT_END_GAME);
+            }
+            escape_length = 0;
+        }
+
+        // Terminal does not report key releases, every key press (or its auto repeat) is good for one step.
+        level->dispatch_event(move);
+        level->dispatch_event(special ? EVENT_BTN_SPECIAL_DOWN : EVENT_BTN_SPECIAL_UP);
+
+        return true;
+    }
+
+    void draw(Level *level, float) {
+        winsize ws;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0
+            && (ws.ws_row != rows || ws.ws_col != columns))
+        {
+            // Terminal has been resized, redraw everything.
+            rows = ws.ws_row;
+            columns = ws.ws_col;
+            // Cleared screen already shows empty fields.
+            shown.assign(Level::LEVEL_WIDTH * Level::LEVEL_HEIGHT, glyph(Field()));
+            status.clear();
+            out += "\x1b[0m\x1b[2J";
+            color = -1;
+            cursor_row = -1;
+        }
+
+        int cell_width = blocks ? 2 : 1;
+        int visible_rows = std::min(level->height(), rows - 1);
+        int visible_columns = std::min(level->width(), columns / cell_width);
+
+        for (int y = 0; y < visible_rows; ++y) {
+            for (int x = 0; x < visible_columns; ++x) {
+                int i = y * level->width() + x;
+                uint16_t g = glyph(level->field(x, y));
+                if (g == shown[i]) {
+                    continue;
+                }
+
+                shown[i] = g;
+                move_to(y, x * cell_width);
+                set_color(blocks ? (g >> 8) + 10 : g >> 8);
+
+                if (blocks) {
+                    out += "  ";
+                } else {
+                    out += (char)(g & 0xff);
+                }
+
+                cursor_column += cell_width;
+            }
+        }
+
+        drawn_step = level->steps_done();
+
+        char line[128];
+        int length = snprintf(line, sizeof(line), "Infotrons: %d  Step: %d%s", level->infotrons_collected,
+            level->steps_done(), level->murphy_alive ? "" : "  Murphy is dead");
+        if (turbo) {
+            snprintf(line + length, sizeof(line) - length, "  Turbo %dx", turbo_speed);
+        }
+
+        if (status != line && visible_rows < rows) {
+            status = line;
+            move_to(visible_rows, 0);
+            set_color(0);
+            out += status;
+            out += "\x1b[K";
+            cursor_row = -1;
+        }
+
+        if (tracer) {
+            tracer->mark(LatencyTracer::STAGE_DRAW);
+        }
+
+        if (profiler) {
+            profiler->enter(PerfProfiler::PHASE_PRESENT);
+        }
+
+        flush();
+
+        if (tracer) {
+            tracer->mark(LatencyTracer::STAGE_PRESENT);
+        }
+    }
+
+    int animation_frames() {
+        return 8;
+    }
+
+    int refresh_rate() {
+        // Nothing moves between game steps.
+        return STEPS_PER_SECOND;
+    }
+
+    /**
+     * t switches turbo on and off, + and - double and halve its speed.
+     */
+    int speed() {
+        return turbo ? turbo_speed : 1;
+    }
+
+    /**
+     * Status line shows the step number, other than that only a resized terminal needs drawing.
+     */
+    bool needs_redraw(const Level *level) {
+        winsize ws;
+        if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && (ws.ws_row != rows || ws.ws_col != columns)) {
+            return true;
+        }
+
+        return level->steps_done() != drawn_step;
+    }
+
+    void save_state(SaveState &) {}
+
+    void load_state(const SaveState &) {}
+
+protected:
+    static const int MAX_TURBO_SPEED = 64;
+    static constexpr std::chrono::milliseconds ESCAPE_TIMEOUT{100}; /**< Longest gap inside an escape sequence. */
+
+    /**
+     * Signals that end the process, including the crashes handled by CellTrace.
+     */
+    static constexpr int RESTORE_SIGNALS[] = { SIGTERM, SIGHUP, SIGINT, SIGQUIT, SIGSEGV, SIGBUS, SIGABRT, SIGFPE, SIGILL };
+
+    static termios restore_termios;
+    static void (*previous_handlers[sizeof(RESTORE_SIGNALS) / sizeof(RESTORE_SIGNALS[0])])(int);
+
+    bool blocks;
+    termios saved_termios;
+    bool turbo;
+    int turbo_speed; /**< Game steps per normal step when turbo is on. */
+    int escape_length; /**< Bytes of escape sequence read so far, 0 outside of one. */
+    std::chrono::steady_clock::time_point escape_start; /**< When the ESC of the unfinished sequence was read. */
+
+    int rows;
+    int columns;
+    int cursor_row;    /**< Where the terminal cursor is, -1 when unknown. */
+    int cursor_column;
+    int color;         /**< Current SGR colour, -1 when unknown. */
+    int drawn_step;    /**< Game step shown in the status line. */
+
+    std::vector<uint16_t> shown; /**< Glyph shown for every field, colour << 8 | character. */
+    std::string status;
+    std::string out;             /**< Output of the current frame. */
+
+    /**
+     * Character and SGR foreground colour of the field.
+     */
+    static uint16_t glyph(const Field &field) {
+        char ch;
+        int fg;
+
+        if (field.hint & (HINT_EXPLOSION | HINT_EXPLOSION_INFOTRON)) {
+            return 93 << 8 | '&';
+        }
+
+        switch (field.type) {
+            case FT_EMPTY:       ch = ' '; fg = 39; break;
+            case FT_ZONK:        ch = 'O'; fg = 37; break;
+            case FT_BASE:        ch = ':'; fg = 32; break;
+            case FT_MURPHY:      ch = '@'; fg = 91; break;
+            case FT_INFOTRON:    ch = '*'; fg = 95; break;
+            case FT_EXIT:        ch = 'E'; fg = 97; break;
+            case FT_ORANGE_DISK: ch = 'o'; fg = 33; break;
+            case FT_YELLOW_DISK: ch = 'o'; fg = 93; break;
+            case FT_RED_DISK:    ch = 'o'; fg = 31; break;
+            case FT_SNIK_SNAK:   ch = 'X'; fg = 97; break;
+            case FT_ELECTRON:    ch = '%'; fg = 96; break;
+            case FT_BUG:         ch = ';'; fg = 92; break;
+            case FT_TERMINAL:    ch = 'T'; fg = 92; break;
+            case FT_BORDER:      ch = '#'; fg = 34; break;
+            case FT_PORT_EAST:
+            case FT_PORT_EAST_2: ch = '>'; fg = 36; break;
+            case FT_PORT_WEST:
+            case FT_PORT_WEST_2: ch = '<'; fg = 36; break;
+            case FT_PORT_SOUTH:
+            case FT_PORT_SOUTH_2: ch = 'v'; fg = 36; break;
+            case FT_PORT_NORTH:
+            case FT_PORT_NORTH_2: ch = '^'; fg = 36; break;
+            case FT_PORT_NS:     ch = '|'; fg = 36; break;
+            case FT_PORT_WE:     ch = '-'; fg = 36; break;
+            case FT_PORT_CROSS:  ch = '+'; fg = 36; break;
+            default:             ch = '#'; fg = 90; break;
+        }
+
+        return fg << 8 | (uint8_t)ch;
+    }
+
+    void move_to(int row, int column) {
+        if (row != cursor_row || column != cursor_column) {
+            char seq[32];
+            snprintf(seq, sizeof(seq), "\x1b[%d;%dH", row + 1, column + 1);
+            out += seq;
+            cursor_row = row;
+            cursor_column = column;
+        }
+    }
+
+    void set_color(int sgr) {
+        if (sgr != color) {
+            char seq[16];
+            snprintf(seq, sizeof(seq), "\x1b[%dm", sgr);
+            out += seq;
+            color = sgr;
+        }
+    }
+
+    /**
+     * Leave the alternate screen and restore the terminal, then let the previous handler (default action, cell trace
+     * dump) handle the signal. Uses only async-signal-safe calls.
+     */
+    static void restore_handler(int sig) {
+        static const char reset[] = "\x1b[0m\x1b[?25h\x1b[?1049l";
+        if (write(STDOUT_FILENO, reset, sizeof(reset) - 1) < 0) {
+            // Nothing else to do, the terminal settings are restored anyway.
+        }
+        tcsetattr(STDIN_FILENO, TCSANOW, &restore_termios);
+
+        for (size_t i = 0; i < sizeof(RESTORE_SIGNALS) / sizeof(RESTORE_SIGNALS[0]); ++i) {
+            if (RESTORE_SIGNALS[i] == sig) {
+                signal(sig, previous_handlers[i]);
+            }
+        }
+
+        raise(sig);
+    }
+
+    void flush() {
+        size_t done = 0;
+        while (done < out.size()) {
+            ssize_t written = write(STDOUT_FILENO, out.data() + done, out.size() - done);
+            if (written <= 0) {
+                break;
+            }
+            done += written;
+        }
+
+        out.clear();
+    }
+};
+
+constexpr std::chrono::milliseconds TerminalDrawer::ESCAPE_TIMEOUT;
+constexpr int TerminalDrawer::RESTORE_SIGNALS[];
+termios TerminalDrawer::restore_termios;
+void (*TerminalDrawer::previous_handlers[sizeof(RESTORE_SIGNALS) / sizeof(RESTORE_SIGNALS[0])])(int);
+#endif
+
+/**
+ * Synthetic levels for worst-case engine loads, written as LEVELS.DAT records that every mode can play through
+ * --levels. Murphy sits in a hardware pocket with a few bases, so he survives everything around him and the load
+ * is not cut short by the end of the game.
+ */
+class StressLevels {
+public:
+    enum Scenario {
+        ZONK_AVALANCHE,  /**< Upper half full of zonks and infotrons rolling down over rows of chips. */
+        ENEMY_CORRIDORS, /**< Snik snaks and electrons wandering in a lattice of corridors. */
+        DISK_CHAIN,      /**< Bands of orange and yellow disks blown up by one falling disk. */
+        EVERYTHING,      /**< All of the above side by side, falling objects reach the enemies and disks. */
+        SCENARIO_COUNT
+    };
+
+    /**
+     * Fill one level record. Variants of the same scenario differ by the seed only.
+     */
+    static void generate(Scenario scenario, uint64_t seed, int variant, uint8_t record[Level::LEVEL_BYTES]) {
+        const int w = Level::LEVEL_WIDTH;
+        const int h = Level::LEVEL_HEIGHT;
+
+        memset(record, 0, Level::LEVEL_BYTES);
+
+        if (scenario == EVERYTHING) {
+            // Thirds of the level taken from the other scenarios.
+            uint8_t part[Level::LEVEL_BYTES];
+            for (int s = 0; s < 3; ++s) {
+                generate((Scenario)s, seed, variant, part);
+                for (int y = 0; y < h; ++y) {
+                    int from = s * w / 3;
+                    int to = (s + 1) * w / 3;
+                    memcpy(record + y * w + from, part + y * w + from, to - from);
+                }
+            }
+        } else {
+            uint64_t rng = seed;
+            for (int y = 1; y < h - 1; ++y) {
+                for (int x = 1; x < w - 1; ++x) {
+                    record[y * w + x] = field(scenario, x, y, random_next(rng) % 100);
+                }
+            }
+        }
+
+        // Hardware around the level and around Murphy's pocket in the bottom left corner.
+        for (int x = 0; x < w; ++x) {
+            record[x] = FT_BORDER;
+            record[(h - 1) * w + x] = FT_BORDER;
+        }
+
+        for (int y = 0; y < h; ++y) {
+            record[y * w] = FT_BORDER;
+            record[y * w + w - 1] = FT_BORDER;
+        }
+
+        for (int i = 1; i <= POCKET_WIDTH + 1; ++i) {
+            record[(h - 2 - POCKET_HEIGHT) * w + i] = FT_BORDER;
+        }
+
+        for (int y = h - 2 - POCKET_HEIGHT; y < h - 1; ++y) {
+            record[y * w + POCKET_WIDTH + 1] = FT_BORDER;
+        }
+
+        for (int y = h - 1 - POCKET_HEIGHT; y < h - 1; ++y) {
+            memset(record + y * w + 1, FT_BASE, POCKET_WIDTH);
+        }
+
+        record[(h - 2) * w + 1] = FT_MURPHY;
+
+        // Header bytes as in the stock levels, infotrons needed 0 means all of them.
+        record[w * h + 5] = ' ';
+
+        char title[Level::LEVEL_NAME_LENGTH + 1];
+        snprintf(title, sizeof(title), "%s %d", NAMES[scenario], variant + 1);
+
+        int len = strlen(title);
+        int pad = (Level::LEVEL_NAME_LENGTH - len) / 2;
+        memset(record + TITLE_OFFSET, '-', Level::LEVEL_NAME_LENGTH);
+        memcpy(record + TITLE_OFFSET + pad, title, len);
+        if (pad > 0) {
+            record[TITLE_OFFSET + pad - 1] = ' ';
+            record[TITLE_OFFSET + pad + len] = ' ';
+        }
+    }
+
+    /**
+     * Write variants of every scenario to the file, level n * SCENARIO_COUNT + s is variant n of scenario s.
+     */
+    static bool write(const char *file_name, int variants, uint64_t seed) {
+        FILE *f = fopen(file_name, "wb");
+        if (!f) {
+            return false;
+        }
+
+        bool ok = true;
+        uint8_t record[Level::LEVEL_BYTES];
+
+        for (int variant = 0; variant < variants && ok; ++variant) {
+            for (int s = 0; s < SCENARIO_COUNT && ok; ++s) {
+                generate((Scenario)s, seed + variant * SCENARIO_COUNT + s, variant, record);
+                ok = fwrite(record, 1, sizeof(record), f) == sizeof(record);
+            }
+        }
+
+        return fclose(f) == 0 && ok;
+    }
+
+protected:
+    static const int TITLE_OFFSET = Level::LEVEL_WIDTH * Level::LEVEL_HEIGHT + 6;
+    static const int POCKET_WIDTH = 3;  /**< Bases Murphy can walk on. */
+    static const int POCKET_HEIGHT = 2;
+
+    static constexpr const char *NAMES[SCENARIO_COUNT] = { "AVALANCHE", "ENEMIES", "DISK CHAIN", "EVERYTHING" };
+
+    /**
+     * Field of the scenario at x, y (inside the hardware frame), roll is a random number 0-99.
+     */
+    static uint8_t field(Scenario scenario, int x, int y, int roll) {
+        switch (scenario) {
+            case ZONK_AVALANCHE:
+                // Solid upper half, everything in it moves as soon as the bottom row falls.
+                if (y <= Level::LEVEL_HEIGHT / 2 - 1) {
+                    return roll < 15 ? FT_INFOTRON : FT_ZONK;
+                }
+
+                // Staggered rows of chips, every falling object rolls off them.
+                if (y % 3 == 0 && (x + y) % 4 == 0) {
+                    return FT_CHIP;
+                }
+
+                return FT_EMPTY;
+
+            case ENEMY_CORRIDORS:
+                // 2x2 blocks of chips between corridors, a third of the corridors has an enemy.
+                if (x % 3 != 0 && y % 3 != 0) {
+                    return FT_CHIP;
+                }
+
+                if (roll < 17) {
+                    return FT_SNIK_SNAK;
+                }
+
+                return roll < 34 ? FT_ELECTRON : FT_EMPTY;
+
+            case DISK_CHAIN:
+                // Orange disk dropping from the top right starts the chain.
+                if (y <= 2) {
+                    if (x == Level::LEVEL_WIDTH - 3) {
+                        return y == 1 ? FT_ORANGE_DISK : FT_EMPTY;
+                    }
+
+                    return FT_BASE;
+                }
+
+                // Rows of yellow and orange disks, every explosion sets off its neighbours. Bases do not explode,
+                // so the chain takes detours around them.
+                if (roll < 12) {
+                    return FT_BASE;
+                }
+
+                return y % 2 ? FT_YELLOW_DISK : FT_ORANGE_DISK;
+
+            default:
+                return FT_EMPTY;
+        }
+    }
+};
+
+constexpr const char *StressLevels::NAMES[];
+
+static const char *LEVELS_FILE = "LEVELS.DAT"; /**< Level pack played by every mode, see --levels. */
+static const char *LEVEL_INDEX_CACHE = "LEVELS.CACHE";
+
+static void usage(const char *app) {
+    fprintf(stderr,
+        "Usage: %s [options]\n"
+        "  --trace-latency          Measure latency from key press to presented frame.\n"
+        "  --trace-json FILE        Write latency samples as Chrome trace.\n"
+        "  --load-state FILE        Start game from save state.\n"
+        "  --no-atlas-cache         Do not cache converted sprites in ATLAS.CACHE.\n"
+        "  --record FILE            Record game inputs to replay file.\n"
+        "  --keyframes N            Store full game state every N steps in recorded replays, 0 for none (default 1000).\n"
+        "  --index-replay FILE      Rewrite replay file with keyframes every --keyframes steps.\n"
+        "  --bench-seek [STEPS]     Compare replay size and seek time for several keyframe intervals (default 50000 steps).\n"
+        "  --check [STEPS]          Check Level against ReferenceLevel with random inputs (default 1000000 steps).\n"
+        "  --replay FILE            Check Level against ReferenceLevel with recorded inputs.\n"
+        "  --seed N                 Seed for random inputs.\n"
+        "  --bench-batch [STEPS]    Measure batch environment throughput (default 2000000 env steps per size).\n"
+        "  --tty                    Play in the terminal instead of a window.\n"
+        "  --tty-blocks             Play in the terminal, fields drawn as colour blocks.\n"
+        "  --level N                Start with level N, following levels are played after it.\n"
+        "  --bench-transition [N]   Measure switching to the next level (default 200 transitions).\n"
+        "  --bench-distance [STEPS] Compare incremental distance fields with full recompute (default 20000 steps).\n"
+        "  --bench-cycles [STEPS]   Play every level without input, skipping ahead once the state repeats (default 100000 steps).\n"
+        "  --stats FILE             Play every level with random inputs, write simulation counters as JSON or CSV.\n"
+        "  --stats-steps N          Steps played in every level by --stats (default 20000).\n"
+        "  --dump-trace FILE        Write cell trace of the last game steps when the game ends.\n"
+        "  --decode-trace FILE      Print cell trace written by --dump-trace or after a crash.\n"
+        "  --fps N                  Frame rate, 0 renders as fast as possible (default display refresh rate).\n"
+        "  --publish                Publish game state to shared memory after every game step.\n"
+        "  --publish-frames         Publish also every rendered frame.\n"
+        "  --bench-publish [STEPS]  Measure cost of publishing to shared memory (default 200000 steps).\n"
+        "  --select                 Choose the level from thumbnails of all levels.\n"
+        "  --list-levels            Print titles, flags and object counts of all levels.\n"
+        "  --levels FILE            Read levels from FILE instead of LEVELS.DAT.\n"
+        "  --generate-stress FILE   Write synthetic worst-case levels for --levels, the same --seed gives the same levels.\n"
+        "  --stress-variants N      Variants of every scenario written by --generate-stress (default 4).\n"
+        "  --mosaic [GAMES]         Watch games with random inputs as thumbnails in one window (default 64 games).\n"
+        "  --bench-mosaic [FRAMES]  Measure frame time of --mosaic (default 2000 frames).\n"
+        "  --draw-threads N         Threads drawing horizontal bands of the window (default number of cores, at most 4).\n"
+        "  --bench-draw [FRAMES]    Measure frame time for 1, 2, 4... draw threads (default 2000 frames of --level).\n"
+        "  --profile                Count cycles, instructions, cache and branch misses of every phase per level, drawn\n"
+        "                           on one thread, and print them when the game ends.\n"
+        "  --profile-json FILE      Write the counters of --profile or --bench-profile as JSON.\n"
+        "  --bench-profile [STEPS]  Play and draw every level with random inputs under --profile (default 2000 steps).\n",
+        app);
+}
+
+/**
+ * Run lockstep check, either for a recorded replay, or fuzz all levels with random inputs.
+ */
+static int run_lockstep_check(const char *replay_file, long steps, uint64_t seed) {
+    LockstepChecker checker(LEVELS_FILE);
+    if (checker.level_count() == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    bool ok;
+
+    if (replay_file) {
+        Replay replay;
+        if (!replay.read(replay_file, LEVELS_FILE)) {
+            fprintf(stderr, "Unable to read replay %s.\n", replay_file);
+            return EXIT_FAILURE;
+        }
+
+        ok = checker.run(replay.level, replay.inputs.data(), replay.inputs.size(), stdout);
+    } else {
+        ok = checker.fuzz(steps, seed, stdout);
+    }
+
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    printf("%s: %ld steps in %ld games, %.2f s, %.0f steps/min.\n", ok ? "OK" : "FAILED",
+        checker.steps, checker.games, seconds, checker.steps / seconds * 60);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Measure environment steps per second of BatchEnv for several batch sizes.
+ */
+static int run_batch_benchmark(long env_steps, uint64_t seed) {
+    static const int sizes[] = { 1, 64, 1024, 16384 };
+
+    printf("%8s %14s %12s\n", "envs", "env steps/s", "us/batch");
+
+    for (int size : sizes) {
+        BatchEnv env(LEVELS_FILE, size, false);
+        if (env.count() == 0) {
+            fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+            return EXIT_FAILURE;
+        }
+
+        std::vector<uint8_t> actions(size);
+        uint64_t rng = seed ? seed : 1;
+
+        long batches = std::max(10L, env_steps / size);
+        auto start = std::chrono::steady_clock::now();
+
+        for (long b = 0; b < batches; ++b) {
+            for (uint8_t &action : actions) {
+                action = random_input(rng);
+            }
+
+            env.step(actions.data());
+        }
+
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        printf("%8d %14.0f %12.1f\n", size, batches * size / seconds, seconds * 1e6 / batches);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Print the level index, and how long it took to build it or to read it from the cache.
+ */
+static int run_list_levels() {
+    auto start = std::chrono::steady_clock::now();
+
+    LevelIndex index;
+    if (!index.open(LEVELS_FILE, LEVEL_INDEX_CACHE)) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+    printf("%3s %-23s %-3s %9s %5s %10s %9s %5s\n", "#", "title", "g/f", "infotrons", "zonks", "snik snaks", "electrons",
+        "disks");
+
+    for (int level = 1; level <= index.count(); ++level) {
+        const LevelIndex::Entry &e = index.entry(level);
+        printf("%3d %-23s %c%c  %9d %5d %10d %9d %5d\n", level, e.title, e.gravitation ? 'G' : '-',
+            e.freeze_zonks ? 'F' : '-', e.infotrons, e.zonks, e.snik_snaks, e.electrons, e.disks);
+    }
+
+    printf("%d levels %s in %.2f ms.\n", index.count(), index.from_cache() ? "read from cache" : "indexed", ms);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Watch games with random inputs in one window, finished games continue with the next level from the pack.
+ */
+static int run_mosaic(int games, int fps, uint64_t seed) {
+    BatchEnv env(LEVELS_FILE, games, false);
+    if (env.count() == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    MosaicDrawer drawer(games);
+
+    if (fps < 0) {
+        fps = drawer.refresh_rate() > 0 ? drawer.refresh_rate() : DEFAULT_FPS;
+    }
+
+    typedef std::chrono::steady_clock Clock;
+    const Clock::duration step_duration = std::chrono::microseconds(1000000 / STEPS_PER_SECOND);
+    Clock::time_point next_step = Clock::now();
+
+    std::vector<uint8_t> actions(games);
+    uint64_t rng = seed ? seed : 1;
+
+    while (drawer.handle_input()) {
+        Clock::time_point frame_start = Clock::now();
+
+        if (frame_start - next_step > step_duration * 4) {
+            next_step = frame_start;
+        }
+
+        while (frame_start >= next_step) {
+            for (uint8_t &action : actions) {
+                action = random_input(rng);
+            }
+
+            env.step(actions.data());
+            next_step += step_duration;
+        }
+
+        drawer.draw(env.observations());
+
+        if (fps > 0) {
+            std::this_thread::sleep_until(std::min(frame_start + std::chrono::microseconds(1000000 / fps), next_step));
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Measure frame time of the mosaic window when every frame follows a game step.
+ */
+static int run_mosaic_benchmark(int games, long frames, uint64_t seed) {
+    BatchEnv env(LEVELS_FILE, games, false);
+    if (env.count() == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    MosaicDrawer drawer(games);
+    std::vector<uint8_t> actions(games);
+    uint64_t rng = seed ? seed : 1;
+
+    // First frame draws every tile.
+    drawer.draw(env.observations());
+
+    double total = 0;
+    double worst = 0;
+
+    for (long frame = 0; frame < frames; ++frame) {
+        for (uint8_t &action : actions) {
+            action = random_input(rng);
+        }
+
+        env.step(actions.data());
+
+        auto start = std::chrono::steady_clock::now();
+        drawer.draw(env.observations());
+        double ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        total += ms;
+        worst = std::max(worst, ms);
+    }
+
+    printf("%d games, %ld frames: %.3f ms/frame average, %.3f ms worst, %.0f FPS possible\n", games, frames,
+        total / frames, worst, frames * 1000.0 / total);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Compare replay size and seek time for several keyframe intervals, on a replay of random inputs.
+ */
+static int run_seek_benchmark(long steps, int level_no, uint64_t seed) {
+    if (level_no < 1 || level_no > Level::level_count(LEVELS_FILE)) {
+        fprintf(stderr, "Unable to read level %d from %s.\n", level_no, LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    static const uint32_t intervals[] = { 0, 100, 1000, 5000 };
+    static const int SEEKS = 50;
+
+    Replay replay;
+    replay.level = level_no;
+    uint64_t rng = seed ? seed : 1;
+
+    for (long i = 0; i < steps; ++i) {
+        replay.inputs.push_back(random_input(rng));
+    }
+
+    std::vector<uint32_t> targets(SEEKS);
+    for (uint32_t &target : targets) {
+        target = random_next(rng) % (steps + 1);
+    }
+
+    // Expected states, by playing the replay from the start.
+    std::vector<uint32_t> sorted(targets);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<SaveState> expected(SEEKS);
+    {
+        Level game(LEVELS_FILE, level_no);
+        uint32_t position = 0;
+
+        for (int i = 0; i < SEEKS; ++i) {
+            for (; position < sorted[i]; ++position) {
+                dispatch_input(&game, replay.inputs[position]);
+                game.game_step();
+            }
+
+            game.save_state(expected[i]);
+        }
+    }
+
+    printf("%ld steps, %d seeks to random steps\n", steps, SEEKS);
+    printf("%10s %12s %10s %14s %14s %11s\n", "interval", "file bytes", "build ms", "seek avg us", "seek worst us",
+        "mismatches");
+
+    for (uint32_t interval : intervals) {
+        auto start = std::chrono::steady_clock::now();
+        replay.build_keyframes(LEVELS_FILE, interval);
+        double build_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+        ReplaySeeker seeker(LEVELS_FILE, replay);
+        double total = 0;
+        double worst = 0;
+        int mismatches = 0;
+        SaveState state;
+
+        for (uint32_t target : targets) {
+            start = std::chrono::steady_clock::now();
+            const Level &game = seeker.seek(target);
+            double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+            total += us;
+            worst = std::max(worst, us);
+
+            int i = std::lower_bound(sorted.begin(), sorted.end(), target) - sorted.begin();
+            game.save_state(state);
+            if (memcmp(&state, &expected[i], sizeof(SaveState)) != 0) {
+                ++mismatches;
+            }
+        }
+
+        printf("%10u %12zu %10.1f %14.1f %14.1f %11d\n", interval, replay.file_size(), build_ms, total / SEEKS, worst,
+            mismatches);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Measure SDLDrawer frame time for several numbers of band threads and window sizes, while playing the level with
+ * random inputs. Every thread count must draw the same pixels as one thread.
+ */
+static int run_draw_benchmark(long frames, int level_no, uint64_t seed) {
+    if (level_no < 1 || level_no > Level::level_count(LEVELS_FILE)) {
+        fprintf(stderr, "Unable to read level %d from %s.\n", level_no, LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    std::vector<int> thread_counts;
+    int cores = std::max(1, (int)std::thread::hardware_concurrency());
+    for (int threads = 1; threads <= std::max(4, cores); threads *= 2) {
+        thread_counts.push_back(threads);
+    }
+
+    bool identical = true;
+
+    printf("%-11s %7s %10s %8s %s\n", "window", "threads", "frame", "speedup", "pixels");
+
+    for (int size = 1; size <= 3; ++size) {
+        std::vector<uint32_t> reference;
+        double single_ms = 0;
+
+        for (int threads : thread_counts) {
+            SDLDrawer drawer(nullptr, threads);
+            drawer.resize(SDLDrawer::FIELD_WIDTH * Level::LEVEL_WIDTH * size,
+                SDLDrawer::FIELD_HEIGHT * Level::LEVEL_HEIGHT * size);
+
+            Level *level = new Level(LEVELS_FILE, level_no);
+            uint64_t rng = seed ? seed : 1;
+            int frames_per_step = drawer.animation_frames();
+
+            std::vector<uint32_t> checksums;
+            checksums.reserve(frames);
+            double total_ms = 0;
+
+            // First frame converts the sprites and splits the window, it is not measured.
+            drawer.draw(level, 0);
+
+            for (long i = 0; i < frames; ++i) {
+                if (i % frames_per_step == 0 && i > 0) {
+                    dispatch_input(level, random_input(rng));
+
+                    if (!level->game_step()) {
+                        delete level;
+                        level = new Level(LEVELS_FILE, level_no);
+                    }
+                }
+
+                auto start = std::chrono::steady_clock::now();
+                drawer.draw(level, (float)(i % frames_per_step) / frames_per_step);
+                total_ms += std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+
+                // FNV-1a of the visible pixels, a word at a time.
+                SDL_Surface *screen = drawer.surface();
+                uint32_t hash = 2166136261u;
+                for (int y = 0; y < screen->h; ++y) {
+                    const uint8_t *row = (const uint8_t *)screen->pixels + y * screen->pitch;
+                    for (int x = 0; x + 4 <= screen->w * screen->format->BytesPerPixel; x += 4) {
+                        uint32_t word;
+                        memcpy(&word, row + x, 4);
+                        hash = (hash ^ word) * 16777619u;
+                    }
+                }
+                checksums.push_back(hash);
+            }
+
+            delete level;
+
+            double frame_ms = total_ms / frames;
+            const char *pixels = "reference";
+            if (threads == 1) {
+                reference = checksums;
+                single_ms = frame_ms;
+            } else if (checksums == reference) {
+                pixels = "identical";
+            } else {
+                pixels = "DIFFERENT";
+                identical = false;
+            }
+
+            char window[32];
+            snprintf(window, sizeof(window), "%dx%d", drawer.surface()->w, drawer.surface()->h);
+            printf("%-11s %7d %7.3f ms %7.2fx %s\n", window, threads, frame_ms, single_ms / frame_ms, pixels);
+        }
+    }
+
+    return identical ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+/**
+ * Measure how much publishing to shared memory adds to a game step and to a frame.
+ */
+static int run_publish_benchmark(long steps, uint64_t seed) {
+    if (Level::level_count(LEVELS_FILE) == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    StatePublisher publisher;
+    if (!publisher.open(true)) {
+        fprintf(stderr, "Unable to create shared memory for publishing.\n");
+        return EXIT_FAILURE;
+    }
+
+    // Run the same inputs twice, without and with publishing, so both runs do identical game steps.
+    double step_ns[2];
+    for (int publish = 0; publish < 2; ++publish) {
+        Level *level = new Level(LEVELS_FILE, 1);
+        uint64_t rng = seed ? seed : 1;
+        int level_no = 1;
+
+        auto start = std::chrono::steady_clock::now();
+
+        for (long i = 0; i < steps; ++i) {
+            dispatch_input(level, random_input(rng));
+
+            if (!level->game_step()) {
+                delete level;
+                level_no = level_no % Level::level_count(LEVELS_FILE) + 1;
+                level = new Level(LEVELS_FILE, level_no);
+            }
+
+            if (publish) {
+                publisher.publish_state(*level);
+            }
+        }
+
+        step_ns[publish] = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / steps;
+        delete level;
+    }
+
+    SDL_Surface *screen = SDL_CreateRGBSurfaceWithFormat(0, SDLDrawer::FIELD_WIDTH * Level::LEVEL_WIDTH,
+        SDLDrawer::FIELD_HEIGHT * Level::LEVEL_HEIGHT, 32, SDL_PIXELFORMAT_RGB888);
+
+    long frames = std::max(100L, steps / 100);
+    auto start = std::chrono::steady_clock::now();
+
+    for (long i = 0; i < frames; ++i) {
+        publisher.publish_frame(screen);
+    }
+
+    double frame_ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count() / frames;
+    SDL_FreeSurface(screen);
+
+    printf("game step:              %10.0f ns\n", step_ns[0]);
+    printf("game step with publish: %10.0f ns (+%.0f ns, %.1f %%)\n", step_ns[1], step_ns[1] - step_ns[0],
+        (step_ns[1] - step_ns[0]) * 100 / step_ns[0]);
+    printf("frame publish (%dx%d):  %10.0f ns (%.3f %% of a %d FPS frame)\n",
+        SDLDrawer::FIELD_WIDTH * Level::LEVEL_WIDTH, SDLDrawer::FIELD_HEIGHT * Level::LEVEL_HEIGHT,
+        frame_ns, frame_ns * DEFAULT_FPS / 1e7, DEFAULT_FPS);
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Play every level with random inputs, drawing every step, and report hardware counters of each phase per level.
+ */
+static int run_profile_benchmark(long steps, uint64_t seed, const char *json_file) {
+    int count = Level::level_count(LEVELS_FILE);
+    if (count == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    PerfProfiler profiler;
+
+    // Counters follow only the thread that opened them, so the whole frame is drawn on this one.
+    SDLDrawer drawer(nullptr, 1);
+    drawer.set_profiler(&profiler);
+
+    uint64_t rng = seed ? seed : 1;
+
+    for (int level_no = 1; level_no <= count; ++level_no) {
+        Level *level = new Level(LEVELS_FILE, level_no);
+        profiler.level(level_no, level->title);
+
+        for (long i = 0; i < steps; ++i) {
+            profiler.enter(PerfProfiler::PHASE_INPUT);
+            dispatch_input(level, random_input(rng));
+
+            profiler.enter(PerfProfiler::PHASE_STEP);
+            bool running = level->game_step();
+
+            profiler.enter(PerfProfiler::PHASE_DRAW);
+            drawer.draw(level, 0);
+            profiler.leave();
+
+            if (!running) {
+                delete level;
+                level = new Level(LEVELS_FILE, level_no);
+            }
+        }
+
+        delete level;
+    }
+
+    profiler.report(stdout);
+
+    if (json_file && !profiler.write_json(json_file)) {
+        fprintf(stderr, "Unable to write profile to %s.\n", json_file);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Play every level with random inputs and write what its simulation did and cost, as JSON, or as CSV when the file
+ * name ends with .csv.
+ */
+static int run_level_statistics(const char *file_name, long steps, uint64_t seed) {
+    int count = Level::level_count(LEVELS_FILE);
+    if (count == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    size_t name_length = strlen(file_name);
+    bool csv = name_length > 4 && strcmp(file_name + name_length - 4, ".csv") == 0;
+
+    FILE *f = fopen(file_name, "w");
+    if (!f) {
+        fprintf(stderr, "Unable to write %s.\n", file_name);
+        return EXIT_FAILURE;
+    }
+
+    if (csv) {
+        fprintf(f, "level,title,games,ns_per_step");
+        for (const SimCounters::Counter &counter : SimCounters::COUNTERS) {
+            fprintf(f, ",%s", counter.name);
+        }
+        fprintf(f, "\n");
+    } else {
+        fprintf(f, "{\"levels\":[\n");
+    }
+
+    uint64_t rng = seed ? seed : 1;
+
+    for (int level_no = 1; level_no <= count; ++level_no) {
+        Level initial(LEVELS_FILE, level_no);
+        SaveState start;
+        initial.save_state(start);
+
+        Level level(start);
+        SimCounters total;
+        long games = 1;
+
+        auto begin = std::chrono::steady_clock::now();
+
+        for (long i = 0; i < steps; ++i) {
+            dispatch_input(&level, random_input(rng));
+
+            if (!level.game_step()) {
+                total += level.counters;
+                level.load_state(start);
+                ++games;
+            }
+        }
+
+        double ns = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - begin).count();
+        total += level.counters;
+
+        // Titles are padded with spaces and contain only plain characters.
+        std::string title(start.title, Level::LEVEL_NAME_LENGTH);
+        title.erase(title.find_last_not_of(' ') + 1);
+        std::replace(title.begin(), title.end(), '"', '\'');
+
+        if (csv) {
+            fprintf(f, "%d,\"%s\",%ld,%.0f", level_no, title.c_str(), games, ns / steps);
+            for (const SimCounters::Counter &counter : SimCounters::COUNTERS) {
+                fprintf(f, ",%llu", (unsigned long long)(total.*counter.value));
+            }
+            fprintf(f, "\n");
+        } else {
+            fprintf(f, "%s{\"level\":%d,\"title\":\"%s\",\"games\":%ld,\"ns_per_step\":%.0f",
+                level_no > 1 ? ",\n" : "", level_no, title.c_str(), games, ns / steps);
+            for (const SimCounters::Counter &counter : SimCounters::COUNTERS) {
+                fprintf(f, ",\"%s\":%llu", counter.name, (unsigned long long)(total.*counter.value));
+            }
+            fprintf(f, "}");
+        }
+    }
+
+    if (!csv) {
+        fprintf(f, "\n]}\n");
+    }
+
+    if (fclose(f) != 0) {
+        fprintf(stderr, "Unable to write %s.\n", file_name);
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
+
+/**
+ * Play every level without input for the given number of steps, once step by step and once jumping ahead as soon as
+ * CycleDetector finds the state repeating. Both must end with the same fields and counters. The cost of detection is
+ * measured by a third run that detects in every step of the plain one, but never jumps.
+ */
+static int run_cycle_benchmark(long steps) {
+    int count = Level::level_count(LEVELS_FILE);
+    if (count == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    typedef std::chrono::steady_clock Clock;
+
+    double plain_ns = 0;
+    double probe_ns = 0;
+    double detect_ns = 0;
+    long plain_steps = 0;
+    long simulated = 0;
+    long saved = 0;
+    int periodic = 0;
+    int mismatches = 0;
+
+    printf("%3s %-23s %-32s %9s %9s\n", "#", "title", "result", "simulated", "saved");
+
+    for (int level_no = 1; level_no <= count; ++level_no) {
+        // Plain simulation up to the step limit or the end of the game.
+        Level plain(LEVELS_FILE, level_no);
+        auto start = Clock::now();
+
+        long plain_done = 0;
+        while (plain_done < steps && plain.game_step()) {
+            ++plain_done;
+        }
+
+        plain_ns += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+        plain_steps += plain_done;
 
-    void explode_9(Field &origin, FieldType fill) {
-        for (int y = origin.coords.y - 1; y <= origin.coords.y + 1; ++y) {
-            for (int x = origin.coords.x - 1; x <= origin.coords.x + 1; ++x) {
-                Field &fld = data[data_idx(Point(x, y))];
-                if (fld.affected_by_explosion()) {
-                    if (fill == FT_EMPTY) {
-                        fld.set_hint(HINT_EXPLOSION | HINT_SKIP);
-                        fld.countdown = EXPLOSION_STEPS;
-                    } else if (fill == FT_INFOTRON) {
-                        fld.set_hint(HINT_EXPLOSION_INFOTRON | HINT_SKIP);
-                        fld.countdown = EXPLOSION_STEPS;
+        // Same steps with detection in every one of them.
+        Level probe(LEVELS_FILE, level_no);
+        start = Clock::now();
+
+        CycleDetector probe_detector(probe);
+        for (long i = 0; i < plain_done && probe.game_step(); ++i) {
+            probe_detector.step(probe);
+        }
+
+        probe_ns += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+
+        // Same game jumping ahead on detection.
+        Level level(LEVELS_FILE, level_no);
+        start = Clock::now();
+
+        CycleDetector detector(level);
+        SimCounters skipped;
+        long done = 0;
+        long detect_from = 0; /**< Step of the last detector reset. */
+        long jumped = 0;
+        bool running = true;
+        char result[64];
+        snprintf(result, sizeof(result), "no cycle");
+
+        while (running && done < steps && (running = level.game_step())) {
+            ++done;
+
+            if (!detector.step(level) || done + detector.period() > steps) {
+                continue;
+            }
+
+            // Confirm with whole fields, fingerprints may collide. The first repeat within the detected period is
+            // the shortest cycle.
+            SaveState *before = new SaveState;
+            SaveState *after = new SaveState;
+            level.save_state(*before);
+            uint64_t fingerprint = level.fingerprint();
+            SimCounters counters = level.counters;
+
+            long period = 0;
+            for (long i = 1; i <= detector.period() && running; ++i) {
+                running = level.game_step();
+                done += running;
+
+                if (running && level.fingerprint() == fingerprint) {
+                    level.save_state(*after);
+                    if (memcmp(before->cells, after->cells, sizeof(before->cells)) == 0) {
+                        period = i;
+                        break;
                     }
                 }
+            }
 
-                if (fld.type == FT_MURPHY) {
-                    murphy_alive = false;
-                }
+            delete before;
+            delete after;
+
+            if (period == 0 || !running) {
+                detector.reset(level);
+                detect_from = done;
+                continue;
             }
+
+            // Skip whole periods, each adds the same counters, and simulate the rest.
+            long periods = (steps - done) / period;
+            for (int c = 0; c < SimCounters::COUNTER_COUNT; ++c) {
+                uint64_t SimCounters::*value = SimCounters::COUNTERS[c].value;
+                skipped.*value = (level.counters.*value - counters.*value) * periods;
+            }
+
+            jumped = periods * period;
+            done += jumped;
+
+            snprintf(result, sizeof(result), "periodic from %ld, period %ld", detect_from + detector.start(), period);
+            ++periodic;
+            break;
         }
 
-        origin.set_hint(HINT_EXPLOSION_ORIGIN);
-    }
+        while (running && done < steps && (running = level.game_step())) {
+            ++done;
+        }
 
-    void move_npc(Field &field, Direction dir) {
-        // Test whether we can rotate left.
-        Point turn_left_pt;
-        Point turn_right_pt;
+        detect_ns += std::chrono::duration<double, std::nano>(Clock::now() - start).count();
 
-        switch (dir) {
-            case DIR_UP:
-                turn_left_pt = next_point(field.coords, DIR_LEFT);
-                turn_right_pt = next_point(field.coords, DIR_RIGHT);
-                break;
+        if (!running) {
+            snprintf(result, sizeof(result), "game over at %ld", done + 1);
+        }
 
-            case DIR_DOWN:
-                turn_left_pt = next_point(field.coords, DIR_RIGHT);
-                turn_right_pt = next_point(field.coords, DIR_LEFT);
-                break;
+        SimCounters total = level.counters;
+        total += skipped;
 
-            case DIR_LEFT:
-                turn_left_pt = next_point(field.coords, DIR_DOWN);
-                turn_right_pt = next_point(field.coords, DIR_UP);
-                break;
+        SaveState *expected = new SaveState;
+        SaveState *actual = new SaveState;
+        plain.save_state(*expected);
+        level.save_state(*actual);
 
-            case DIR_RIGHT:
-                turn_left_pt = next_point(field.coords, DIR_UP);
-                turn_right_pt = next_point(field.coords, DIR_DOWN);
-                break;
+        bool match = done == plain_done && memcmp(expected->cells, actual->cells, sizeof(expected->cells)) == 0;
+        for (int c = 0; c < SimCounters::COUNTER_COUNT; ++c) {
+            match &= total.*SimCounters::COUNTERS[c].value == plain.counters.*SimCounters::COUNTERS[c].value;
+        }
 
-            default:
-                break;
+        delete expected;
+        delete actual;
+
+        if (!match) {
+            ++mismatches;
+            snprintf(result + strlen(result), sizeof(result) - strlen(result), " MISMATCH");
         }
 
-        Direction can_turn = DIR_NONE;
+        std::string title(level.title, Level::LEVEL_NAME_LENGTH);
+        printf("%3d %-23s %-32s %9ld %9ld\n", level_no, title.c_str(), result, done - jumped, jumped);
 
-        if (!field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
-            Field &turn_left = data[data_idx(turn_left_pt)];
-            Field &turn_right = data[data_idx(turn_right_pt)];
+        simulated += done - jumped;
+        saved += jumped;
+    }
 
-            if (turn_left.type == FT_EMPTY && !turn_left.has_hint(HINT_LEAVING)) {
-                can_turn = DIR_LEFT;
-            } else if (turn_right.type == FT_EMPTY && !turn_right.has_hint(HINT_LEAVING)) {
-                can_turn = DIR_RIGHT;
-            }
-        }
+    printf("%d of %d levels periodic, %ld steps simulated, %ld steps (%.1f%%) skipped.\n", periodic, count, simulated,
+        saved, 100.0 * saved / std::max(1L, simulated + saved));
+    printf("plain:           %8.0f ns/step, %8.1f ms total\n", plain_ns / std::max(1L, plain_steps), plain_ns / 1e6);
+    printf("detecting:       %8.0f ns/step, %8.1f ms total, %+.1f%% per step\n", probe_ns / std::max(1L, plain_steps),
+        probe_ns / 1e6, 100.0 * (probe_ns - plain_ns) / std::max(1.0, plain_ns));
+    printf("jumping ahead:                     %8.1f ms total\n", detect_ns / 1e6);
+    printf("mismatching levels: %d\n", mismatches);
 
-        // Clear current move, because we already now what we are going to do here.
-        field.del_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT | HINT_FROM_TOP | HINT_FROM_BOTTOM | HINT_FROM_LEFT | HINT_FROM_RIGHT);
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-        Point next_pt = next_point(field.coords, dir);
-        Field &next = data[data_idx(next_pt)];
+/**
+ * Compare incremental update of distance fields with computing them from scratch after every step, and check that
+ * both give the same distances.
+ */
+static int run_distance_benchmark(long steps, uint64_t seed) {
+    int count = Level::level_count(LEVELS_FILE);
+    if (count == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
 
-        bool moving = false;
+    static const FieldType targets[] = { FT_INFOTRON, FT_EXIT };
+    const int fields = Level::LEVEL_WIDTH * Level::LEVEL_HEIGHT;
 
-        if ((can_turn == DIR_NONE || can_turn == DIR_RIGHT) && !next.has_hint(HINT_LEAVING)) {
-            if (next.type == FT_EMPTY) {
-                next.type = field.type;
-				next.set_hint(hint_from_direction(dir) | HINT_SKIP);
+    DistanceField incremental[2];
+    DistanceField scratch;
 
-                field.type = FT_EMPTY;
-                field.set_hint(HINT_LEAVING);
+    Level *level = nullptr;
+    int level_no = 0;
+    uint64_t rng = seed ? seed : 1;
+    long mismatches = 0;
+    double update_ns = 0;
+    double full_ns = 0;
 
-                moving = true;
-            } else if (next.type == FT_MURPHY) {
-                explode_9(next, FT_EMPTY);
+    for (long i = 0; i < steps; ++i) {
+        if (!level) {
+            level_no = level_no % count + 1;
+            level = new Level(LEVELS_FILE, level_no);
+            level->enable_journal();
+
+            for (int t = 0; t < 2; ++t) {
+                incremental[t].rebuild(&level->field(0, 0), Level::LEVEL_WIDTH, Level::LEVEL_HEIGHT, Level::STRIDE, targets[t]);
             }
+        }
 
-            next.set_hint(HINT_SKIP);
+        dispatch_input(level, random_input(rng));
+        bool cont = level->game_step();
+
+        for (int t = 0; t < 2; ++t) {
+            auto start = std::chrono::steady_clock::now();
+            incremental[t].update(level->changes());
+            auto middle = std::chrono::steady_clock::now();
+            scratch.rebuild(&level->field(0, 0), Level::LEVEL_WIDTH, Level::LEVEL_HEIGHT, Level::STRIDE, targets[t]);
+            auto end = std::chrono::steady_clock::now();
+
+            update_ns += std::chrono::duration<double, std::nano>(middle - start).count();
+            full_ns += std::chrono::duration<double, std::nano>(end - middle).count();
+
+            for (int f = 0; f < fields; ++f) {
+                mismatches += scratch.distance(f) != incremental[t].distance(f);
+            }
         }
 
-        if (!moving && can_turn == DIR_LEFT) {
-            // Rotate left.
-			field.set_hint(hint_from_direction(turn_left(dir)) | HINT_TURN_LEFT);
-        } else if (!moving) {
-            // Rotate right.
-			field.set_hint(hint_from_direction(turn_right(dir)) | HINT_TURN_RIGHT);
+        if (!cont) {
+            delete level;
+            level = nullptr;
         }
     }
-};
 
-/**
- * Abstract class that represents UI.
- */
-class Drawer {
-public:
-    virtual ~Drawer() {}
+    delete level;
 
-    /**
-     * Handle input events. Return true, if the loop should continue, false if the game should be aborted.
-     */
-    virtual bool handle_input(Level *game) = 0;
+    printf("incremental update: %8.0f ns/step (infotron and exit fields)\n", update_ns / steps);
+    printf("full recompute:     %8.0f ns/step (infotron and exit fields)\n", full_ns / steps);
+    printf("mismatching distances: %ld\n", mismatches);
 
-    /**
-     * Draw game field to the screen.
-     */
-    virtual void draw(Level *game, int animation_frame) = 0;
+    return mismatches == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
 
-    /**
-     * Return number of animation frames for each game step.
-     */
-    virtual int animation_frames() = 0;
-};
+/**
+ * Drop the file from the page cache, so the next read goes to the disk.
+ */
+static void evict_from_page_cache(const char *file_name) {
+#ifndef _WIN32
+    int fd = open(file_name, O_RDONLY);
+    if (fd >= 0) {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+#else
+    (void)file_name;
+#endif
+}
 
 /**
- * SDL based interface.
+ * Measure how long the game thread is blocked when switching to the next level, loading it synchronously and with
+ * LevelSequencer, with the level pack in the page cache and evicted from it.
  */
-class SDLDrawer: public Drawer {
-public:
-    static const int FIELD_WIDTH = 16;
-    static const int FIELD_HEIGHT = 16;
+static int run_transition_benchmark(int transitions) {
+    int count = Level::level_count(LEVELS_FILE);
+    if (count == 0) {
+        fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
 
-public:
-    SDLDrawer(): last_murphy_side_move(DIR_LEFT) {
-        SDL_Init(SDL_INIT_VIDEO);
-        window = SDL_CreateWindow("Supaplex", SDL_WINDOWPOS_UNDEFINED, SDL_WINDOWPOS_UNDEFINED, FIELD_WIDTH * 60, FIELD_HEIGHT * 24, SDL_WINDOW_RESIZABLE);
+    typedef std::chrono::steady_clock Clock;
 
-        fixed = SDL_LoadBMP("FIXED.bmp");
-        moving = SDL_LoadBMP("MOVING2.bmp");
-    }
+    printf("%-16s %10s %10s\n", "transition", "mean [us]", "max [us]");
 
-    ~SDLDrawer() {
-        SDL_FreeSurface(fixed);
-        SDL_FreeSurface(moving);
+    for (int cold = 0; cold < 2; ++cold) {
+        double total = 0, max = 0;
 
-        SDL_DestroyWindow(window);
-        SDL_Quit();
+        Level *level = new Level(LEVELS_FILE, 1);
+        for (int i = 0; i < transitions; ++i) {
+            if (cold) {
+                evict_from_page_cache(LEVELS_FILE);
+            }
+
+            auto start = Clock::now();
+            delete level;
+            level = new Level(LEVELS_FILE, (i + 1) % count + 1);
+            double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
+
+            total += us;
+            max = std::max(max, us);
+        }
+        delete level;
+
+        printf("%-16s %10.1f %10.1f\n", cold ? "sync, cold" : "sync", total / transitions, max);
     }
 
-    bool handle_input(Level *level) {
-        SDL_Event event;
-        while (SDL_PollEvent(&event)) {
-            switch (event.type) {
-                case SDL_QUIT:
-                    return false;
+    for (int cold = 0; cold < 2; ++cold) {
+        double total = 0, max = 0;
 
-                case SDL_KEYDOWN:
-                    switch (event.key.keysym.sym) {
-                        case SDLK_UP:
-                            if (keyboard_down[KBD_UP] == 0) {
-                                keyboard_down[KBD_UP] = 1;
-                            }
-                            break;
+        LevelSequencer sequencer(LEVELS_FILE, 1);
+        for (int i = 0; i < transitions; ++i) {
+            // Stands for the level being played, the next one is loaded meanwhile.
+            std::this_thread::sleep_for(std::chrono::milliseconds(2));
 
-                        case SDLK_DOWN:
-                            if (keyboard_down[KBD_DOWN] == 0) {
-                                keyboard_down[KBD_DOWN] = 1;
-                            }
-                            break;
+            if (cold) {
+                evict_from_page_cache(LEVELS_FILE);
+            }
 
-                        case SDLK_LEFT:
-                            if (keyboard_down[KBD_LEFT] == 0) {
-                                keyboard_down[KBD_LEFT] = 1;
-                            }
-                            break;
+            auto start = Clock::now();
+            sequencer.advance();
+            double us = std::chrono::duration<double, std::micro>(Clock::now() - start).count();
 
-                        case SDLK_RIGHT:
-                            if (keyboard_down[KBD_RIGHT] == 0) {
-                                keyboard_down[KBD_RIGHT] = 1;
-                            }
-                            break;
+            total += us;
+            max = std::max(max, us);
+        }
 
-                        case SDLK_SPACE:
-                            keyboard_down[KBD_SPACE] = 1;
-                            break;
-                    }
-                    break;
+        printf("%-16s %10.1f %10.1f\n", cold ? "prefetch, cold" : "prefetch", total / transitions, max);
+    }
 
-                case SDL_KEYUP:
-                    switch (event.key.keysym.sym) {
-                        case SDLK_UP:
-                            if (keyboard_down[KBD_UP] == 1) {
-                                // was up, but only for this round, will go down after processed.
-                                keyboard_down[KBD_UP] = 3;
-                            } else if (keyboard_down[KBD_UP] == 2) {
-                                // was up, goes immediately down.
-                                keyboard_down[KBD_UP] = 0;
-                            }
-                            break;
+    return EXIT_SUCCESS;
+}
 
-                        case SDLK_DOWN:
-                            if (keyboard_down[KBD_DOWN] == 1) {
-                                keyboard_down[KBD_DOWN] = 3;
-                            } else if (keyboard_down[KBD_DOWN] == 2) {
-                                keyboard_down[KBD_DOWN] = 0;
-                            }
-                            break;
+/**
+ * Print dumped cell trace, one line per record, fields formatted as Field::to_string() does.
+ */
+static int decode_cell_trace(const char *file_name) {
+    FILE *f = fopen(file_name, "rb");
+    if (!f) {
+        fprintf(stderr, "Unable to open %s.\n", file_name);
+        return EXIT_FAILURE;
+    }
 
-                        case SDLK_LEFT:
-                            if (keyboard_down[KBD_LEFT] == 1) {
-                                keyboard_down[KBD_LEFT] = 3;
-                            } else if (keyboard_down[KBD_LEFT] == 2) {
-                                keyboard_down[KBD_LEFT] = 0;
-                            }
-                            break;
+    CellTraceHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1 || header.magic != CellTraceHeader::MAGIC
+        || header.record_size != sizeof(CellTraceRecord))
+    {
+        fprintf(stderr, "%s is not a cell trace.\n", file_name);
+        fclose(f);
+        return EXIT_FAILURE;
+    }
 
-                        case SDLK_RIGHT:
-                            if (keyboard_down[KBD_RIGHT] == 1) {
-                                keyboard_down[KBD_RIGHT] = 3;
-                            } else if (keyboard_down[KBD_RIGHT] == 2) {
-                                keyboard_down[KBD_RIGHT] = 0;
-                            }
-                            break;
+    static const char *sources[] = { "murphy", "fall", "npc", "explosion" };
 
-                        case SDLK_SPACE:
-                            keyboard_down[KBD_SPACE] = 0;
-                            break;
+    printf("%u of %llu records.\n", header.count, (unsigned long long)header.total);
 
-                        case SDLK_ESCAPE:
-                            level->dispatch_event(EVENT_END_GAME);
-                            break;
-                    }
-                    break;
-            }
-        }
+    CellTraceRecord r;
+    for (uint32_t i = 0; i < header.count && fread(&r, sizeof(r), 1, f) == 1; ++i) {
+        Field before;
+        before.coords = Point(r.cell % Level::LEVEL_WIDTH, r.cell / Level::LEVEL_WIDTH);
+        before.type = (FieldType)r.old_type;
+        before.hint = r.old_hint;
 
-        if (keyboard_down[KBD_UP] > 0) {
-            level->dispatch_event(EVENT_MOVE_UP);
-        } else if (keyboard_down[KBD_DOWN] > 0) {
-            level->dispatch_event(EVENT_MOVE_DOWN);
-        } else if (keyboard_down[KBD_LEFT] > 0) {
-            level->dispatch_event(EVENT_MOVE_LEFT);
-        } else if (keyboard_down[KBD_RIGHT] > 0) {
-            level->dispatch_event(EVENT_MOVE_RIGHT);
+        Field after = before;
+        after.type = (FieldType)r.new_type;
+        after.hint = r.new_hint;
+
+        printf("%6u %6u %-9s %s -> %s countdown %d\n", r.game, r.step, r.source < 4 ? sources[r.source] : "?",
+            before.to_string().c_str(), after.to_string().c_str(), r.countdown);
+    }
+
+    fclose(f);
+    return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv) {
+    LatencyTracer *tracer = nullptr;
+    const char *trace_json = nullptr;
+    const char *load_file = nullptr;
+    const char *atlas_cache = "ATLAS.CACHE";
+    const char *record_file = nullptr;
+    const char *replay_file = nullptr;
+    bool check = false;
+    long bench_batch = 0;
+    long bench_publish = 0;
+    bool publish = false;
+    bool publish_frames = false;
+    int fps = -1;
+    const char *dump_trace = nullptr;
+    const char *stats_file = nullptr;
+    long stats_steps = 20000;
+    long bench_distance = 0;
+    long bench_cycles = 0;
+    int bench_transition = 0;
+    int first_level = 1;
+    int tty = 0; /**< 1 for characters, 2 for colour blocks. */
+    int mosaic = 0;
+    uint32_t keyframes = 1000;
+    const char *index_replay = nullptr;
+    long bench_seek = 0;
+    bool select = false;
+    bool list_levels = false;
+    const char *stress_file = nullptr;
+    int stress_variants = 4;
+    long bench_mosaic = 0;
+    int draw_threads = std::max(1, std::min(4, (int)std::thread::hardware_concurrency()));
+    long bench_draw = 0;
+    bool profile = false;
+    const char *profile_json = nullptr;
+    long bench_profile = 0;
+    long check_steps = 1000000;
+    uint64_t seed = time(NULL);
+
+    for (int i = 1; i < argc; ++i) {
+        if (strcmp(argv[i], "--trace-latency") == 0) {
+            if (!tracer) {
+                tracer = new LatencyTracer();
+            }
+        } else if (strcmp(argv[i], "--trace-json") == 0 && i + 1 < argc) {
+            trace_json = argv[++i];
+            if (!tracer) {
+                tracer = new LatencyTracer();
+            }
+        } else if (strcmp(argv[i], "--load-state") == 0 && i + 1 < argc) {
+            load_file = argv[++i];
+        } else if (strcmp(argv[i], "--no-atlas-cache") == 0) {
+            atlas_cache = nullptr;
+        } else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+            record_file = argv[++i];
+        } else if (strcmp(argv[i], "--check") == 0) {
+            check = true;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                check_steps = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--bench-batch") == 0) {
+            bench_batch = 2000000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_batch = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--tty") == 0) {
+            tty = 1;
+        } else if (strcmp(argv[i], "--tty-blocks") == 0) {
+            tty = 2;
+        } else if (strcmp(argv[i], "--level") == 0 && i + 1 < argc) {
+            first_level = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-transition") == 0) {
+            bench_transition = 200;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_transition = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--bench-distance") == 0) {
+            bench_distance = 20000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_distance = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--bench-cycles") == 0) {
+            bench_cycles = 100000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_cycles = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--stats") == 0 && i + 1 < argc) {
+            stats_file = argv[++i];
+        } else if (strcmp(argv[i], "--stats-steps") == 0 && i + 1 < argc) {
+            stats_steps = atol(argv[++i]);
+        } else if (strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc) {
+            return decode_cell_trace(argv[++i]);
+        } else if (strcmp(argv[i], "--dump-trace") == 0 && i + 1 < argc) {
+            dump_trace = argv[++i];
+        } else if (strcmp(argv[i], "--fps") == 0 && i + 1 < argc) {
+            fps = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--publish") == 0) {
+            publish = true;
+        } else if (strcmp(argv[i], "--publish-frames") == 0) {
+            publish = true;
+            publish_frames = true;
+        } else if (strcmp(argv[i], "--bench-publish") == 0) {
+            bench_publish = 200000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_publish = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--keyframes") == 0 && i + 1 < argc) {
+            keyframes = strtoul(argv[++i], nullptr, 10);
+        } else if (strcmp(argv[i], "--index-replay") == 0 && i + 1 < argc) {
+            index_replay = argv[++i];
+        } else if (strcmp(argv[i], "--bench-seek") == 0) {
+            bench_seek = 50000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_seek = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--select") == 0) {
+            select = true;
+        } else if (strcmp(argv[i], "--list-levels") == 0) {
+            list_levels = true;
+        } else if (strcmp(argv[i], "--levels") == 0 && i + 1 < argc) {
+            LEVELS_FILE = argv[++i];
+        } else if (strcmp(argv[i], "--generate-stress") == 0 && i + 1 < argc) {
+            stress_file = argv[++i];
+        } else if (strcmp(argv[i], "--stress-variants") == 0 && i + 1 < argc) {
+            stress_variants = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--mosaic") == 0) {
+            mosaic = 64;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                mosaic = atoi(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--bench-mosaic") == 0) {
+            bench_mosaic = 2000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_mosaic = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--draw-threads") == 0 && i + 1 < argc) {
+            draw_threads = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "--bench-draw") == 0) {
+            bench_draw = 2000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_draw = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            profile = true;
+        } else if (strcmp(argv[i], "--profile-json") == 0 && i + 1 < argc) {
+            profile_json = argv[++i];
+            profile = true;
+        } else if (strcmp(argv[i], "--bench-profile") == 0) {
+            bench_profile = 2000;
+            if (i + 1 < argc && argv[i + 1][0] != '-') {
+                bench_profile = atol(argv[++i]);
+            }
+        } else if (strcmp(argv[i], "--replay") == 0 && i + 1 < argc) {
+            replay_file = argv[++i];
+        } else if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc) {
+            seed = strtoull(argv[++i], nullptr, 10);
         } else {
-            level->dispatch_event(EVENT_MOVE_NONE);
+            usage(argv[0]);
+            return EXIT_FAILURE;
         }
+    }
 
-        if (keyboard_down[KBD_UP] == 3) {
-            keyboard_down[KBD_UP] = 0;
-        } else if (keyboard_down[KBD_UP] == 1) {
-            keyboard_down[KBD_UP] = 2;
+    if (stress_file) {
+        if (!StressLevels::write(stress_file, stress_variants, seed)) {
+            fprintf(stderr, "Unable to write %s.\n", stress_file);
+            return EXIT_FAILURE;
         }
 
-        if (keyboard_down[KBD_DOWN] == 3) {
-            keyboard_down[KBD_DOWN] = 0;
-        } else if (keyboard_down[KBD_DOWN] == 1) {
-            keyboard_down[KBD_DOWN] = 2;
-        }
+        return EXIT_SUCCESS;
+    }
 
-        if (keyboard_down[KBD_LEFT] == 3) {
-            keyboard_down[KBD_LEFT] = 0;
-        } else if (keyboard_down[KBD_LEFT] == 1) {
-            keyboard_down[KBD_LEFT] = 2;
-        }
+    if (list_levels) {
+        return run_list_levels();
+    }
 
-        if (keyboard_down[KBD_RIGHT] == 3) {
-            keyboard_down[KBD_RIGHT] = 0;
-        } else if (keyboard_down[KBD_RIGHT] == 1) {
-            keyboard_down[KBD_RIGHT] = 2;
-        }
+    if (bench_batch > 0) {
+        return run_batch_benchmark(bench_batch, seed);
+    }
 
-        if (keyboard_down[KBD_SPACE]) {
-            level->dispatch_event(EVENT_BTN_SPECIAL_DOWN);
-        } else {
-            level->dispatch_event(EVENT_BTN_SPECIAL_UP);
-        }
+#if CELL_TRACE
+    CellTrace::install_crash_handler();
+#else
+    if (dump_trace) {
+        fprintf(stderr, "Cell trace is not compiled in, --dump-trace is ignored.\n");
+    }
+#endif
 
-        return true;
+    if (bench_transition > 0) {
+        return run_transition_benchmark(bench_transition);
     }
 
-    void draw(Level *level, int animation_frame) {
-        SDL_Surface *screen = SDL_GetWindowSurface(window);
+    if (bench_distance > 0) {
+        return run_distance_benchmark(bench_distance, seed);
+    }
 
-        SDL_Rect source;
-        source.x = 0;
-        source.y = 0;
-        source.w = FIELD_WIDTH;
-        source.h = FIELD_HEIGHT;
+    if (bench_cycles > 0) {
+        return run_cycle_benchmark(bench_cycles);
+    }
 
-        SDL_Rect dest;
-        dest.x = 0;
-        dest.y = 0;
-        dest.w = FIELD_WIDTH;
-        dest.h = FIELD_HEIGHT;
+    if (stats_file) {
+        return run_level_statistics(stats_file, stats_steps, seed);
+    }
 
-        SDL_Rect source_empty;
-        source_empty.x = 0;
-        source_empty.y = 0;
-        source_empty.w = FIELD_WIDTH;
-        source_empty.h = FIELD_HEIGHT;
+    if (bench_publish > 0) {
+        return run_publish_benchmark(bench_publish, seed);
+    }
 
-        SDL_Rect source_infotron = source_empty;
-        source_infotron.x = FIELD_WIDTH * FT_INFOTRON;
+    if (bench_seek > 0) {
+        return run_seek_benchmark(bench_seek, first_level, seed);
+    }
 
-        SDL_Rect source_base = source_empty;
-        source_base.x = FIELD_WIDTH * FT_BASE;
+    if (index_replay) {
+        Replay replay;
+        if (!replay.read(index_replay, LEVELS_FILE)) {
+            fprintf(stderr, "Unable to read replay %s.\n", index_replay);
+            return EXIT_FAILURE;
+        }
 
-        SDL_Rect source_red_disk = source_empty;
-        source_red_disk.x = FIELD_WIDTH * FT_RED_DISK;
+        replay.build_keyframes(LEVELS_FILE, keyframes);
+        if (!replay.write(index_replay)) {
+            fprintf(stderr, "Unable to write replay %s.\n", index_replay);
+            return EXIT_FAILURE;
+        }
 
-        SDL_Surface *source_surface;
+        return EXIT_SUCCESS;
+    }
 
-        int move_offset = FIELD_HEIGHT / animation_frames();
+    if (bench_draw > 0) {
+        return run_draw_benchmark(bench_draw, first_level, seed);
+    }
 
-        // Draw static fields.
-        for (int ly = 0; ly < level->height(); ++ly) {
-            for (int lx = 0; lx < level->width(); ++lx) {
-                dest.y = ly * FIELD_HEIGHT;
-                dest.x = lx * FIELD_WIDTH;
+    if (bench_profile > 0) {
+        return run_profile_benchmark(bench_profile, seed, profile_json);
+    }
 
-                Field &field = level->data[ly * level->width() + lx];
+    if (bench_mosaic > 0) {
+        return run_mosaic_benchmark(mosaic > 0 ? mosaic : 64, bench_mosaic, seed);
+    }
 
-                source.y = 0;
-                source.x = field.type * FIELD_WIDTH;
+    if (mosaic > 0) {
+        return run_mosaic(mosaic, fps, seed);
+    }
 
-                SDL_BlitSurface(fixed, &source, screen, &dest);
-            }
+    if (check || replay_file) {
+        return run_lockstep_check(replay_file, check_steps, seed);
+    }
+
+    if (record_file && load_file) {
+        fprintf(stderr, "Replays start at the beginning of a level, --record cannot be combined with --load-state.\n");
+        return EXIT_FAILURE;
+    }
+
+    if (!load_file && (first_level < 1 || first_level > Level::level_count(LEVELS_FILE))) {
+        fprintf(stderr, "Unable to read level %d from %s.\n", first_level, LEVELS_FILE);
+        return EXIT_FAILURE;
+    }
+
+    if (select && !load_file) {
+        LevelIndex index;
+        if (!index.open(LEVELS_FILE, LEVEL_INDEX_CACHE)) {
+            fprintf(stderr, "Unable to read levels from %s.\n", LEVELS_FILE);
+            return EXIT_FAILURE;
         }
 
-        for (int ly = 0; ly < level->height(); ++ly) {
-            for (int lx = 0; lx < level->width(); ++lx) {
-                dest.y = ly * FIELD_HEIGHT;
-                dest.x = lx * FIELD_WIDTH;
+        LevelSelect screen(index);
+        first_level = screen.run(first_level);
+        if (first_level == 0) {
+            return EXIT_SUCCESS;
+        }
+    }
 
-                source_surface = fixed;
+    Replay replay;
+    replay.level = first_level;
+    replay.keyframe_interval = keyframes;
 
-                bool need_draw = false;
+    Level *level;
+    LevelSequencer *sequencer = nullptr;
+    Drawer *drawer;
 
-                Field &field = level->data[ly * level->width() + lx];
+    if (profile) {
+        // Counters follow only the thread that opened them, so the whole frame is drawn on this one.
+        draw_threads = 1;
+    }
 
-                source.y = 0;
-                source.x = field.type * FIELD_WIDTH;
+#ifndef _WIN32
+    if (tty) {
+        drawer = new TerminalDrawer(tty == 2);
+    } else {
+        drawer = new SDLDrawer(atlas_cache, draw_threads);
+    }
+#else
+    if (tty) {
+        fprintf(stderr, "Terminal interface is not available on Windows.\n");
+        return EXIT_FAILURE;
+    }
 
-                if (field.has_hint(HINT_FALL) || field.has_hint(HINT_FROM_TOP) || field.has_hint(HINT_FROM_BOTTOM)
-                        || field.has_hint(HINT_FROM_LEFT) || field.has_hint(HINT_FROM_RIGHT)) {
+    drawer = new SDLDrawer(atlas_cache, draw_threads);
+#endif
 
-                    if (field.has_hint(HINT_WAS_INFOTRON)) {
-                        SDL_BlitSurface(fixed, &source_infotron, screen, &dest);
-                    } else if (field.has_hint(HINT_WAS_BASE)) {
-                        SDL_BlitSurface(fixed, &source_base, screen, &dest);
-                    } else if (field.has_hint(HINT_WAS_RED_DISK)) {
-                        SDL_BlitSurface(fixed, &source_red_disk, screen, &dest);
-                    } else {
-                        SDL_BlitSurface(fixed, &source_empty, screen, &dest);
-                    }
+    drawer->set_latency_tracer(tracer);
 
-                    need_draw = true;
-                } else if (field.has_hint(HINT_WAS_INFOTRON | HINT_WAS_BASE | HINT_WAS_RED_DISK)) {
-                    // Draw remote eating animation
-                    // 22, 23, 24
-                    source_surface = moving;
-                    source.x = animation_frame * FIELD_WIDTH;
+    PerfProfiler *profiler = nullptr;
+    if (profile) {
+        profiler = new PerfProfiler();
+        drawer->set_profiler(profiler);
+    }
 
-                    if (field.has_hint(HINT_WAS_BASE)) {
-                        source.y = 21 * FIELD_HEIGHT;
-                    } else if (field.has_hint(HINT_WAS_INFOTRON)) {
-                        source.y = 22 * FIELD_HEIGHT;
-                    } else if (field.has_hint(HINT_WAS_RED_DISK)) {
-                        source.y = 23 * FIELD_HEIGHT;
-                    }
+    StatePublisher *publisher = nullptr;
+    if (publish) {
+        publisher = new StatePublisher();
+        if (publisher->open(publish_frames)) {
+            drawer->set_publisher(publisher);
+        } else {
+            fprintf(stderr, "Unable to create shared memory, state will not be published.\n");
+            delete publisher;
+            publisher = nullptr;
+        }
+    }
 
-                    need_draw = true;
-                }
+    typedef std::chrono::steady_clock Clock;
+    const Clock::duration step_duration = std::chrono::microseconds(1000000 / STEPS_PER_SECOND);
 
-                if (field.has_hint(HINT_FALL)) {
-                    dest.y = dest.y - FIELD_HEIGHT + move_offset * animation_frame;
-                } else if (field.has_hint(HINT_FROM_TOP) && !field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
-                    dest.y = dest.y - FIELD_HEIGHT + move_offset * animation_frame;
-                } else if (field.has_hint(HINT_FROM_BOTTOM) && !field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
-                    dest.y = dest.y + FIELD_HEIGHT - move_offset * animation_frame;
-                } else if (field.has_hint(HINT_FROM_LEFT) && !field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
-                    dest.x = dest.x - FIELD_HEIGHT + move_offset * animation_frame;
-                } else if (field.has_hint(HINT_FROM_RIGHT) && !field.has_hint(HINT_TURN_LEFT | HINT_TURN_RIGHT)) {
-                    dest.x = dest.x + FIELD_HEIGHT - move_offset * animation_frame;
-                }
+    if (fps < 0) {
+        fps = drawer->refresh_rate() > 0 ? drawer->refresh_rate() : DEFAULT_FPS;
+    }
 
-                if (has_animation(field)) {
-                    source_surface = moving;
-                    need_draw = true;
+    time_t level_start = time(NULL) + 2;
+    Clock::time_point step_start = Clock::now(); /**< When the last game step has been done. */
+    Clock::time_point next_step = step_start;    /**< When the next game step is due. */
+
+    if (load_file) {
+        SaveStateFile file(load_file);
+        if (!file.state()) {
+            fprintf(stderr, "Save state %s is missing or invalid.\n", load_file);
+            delete drawer;
+            return EXIT_FAILURE;
+        }
 
-                    int turn_offset = 0;
-                    if (field.has_hint(HINT_TURN_LEFT)) {
-                        turn_offset = 4;
-                    } else if (field.has_hint(HINT_TURN_RIGHT)) {
-                        turn_offset = 8;
-                    }
+        level = new Level(*file.state());
+        drawer->load_state(*file.state());
 
-                    if (field.has_hint(HINT_EXPLOSION)) {
-                        // Extend explosion animation to 4 game steps.
-                        source.x = ((animation_frame >> 2) + ((EXPLOSION_STEPS - field.countdown) << 1)) * FIELD_WIDTH;
-                        source.y = 6 * FIELD_HEIGHT;
-                    }
+        // State saved in the middle of a step continues with the rest of its animation.
+        int animation_frame = file.state()->animation_frame % drawer->animation_frames();
+        if (animation_frame > 0) {
+            step_start = Clock::now() - step_duration * animation_frame / drawer->animation_frames();
+            next_step = step_start + step_duration;
+        }
 
-                    else if (field.has_hint(HINT_FROM_LEFT)
-                            || (field.type == FT_MURPHY && last_murphy_side_move == DIR_RIGHT &&
-                                field.has_hint(HINT_FROM_TOP | HINT_FROM_BOTTOM)))
-                    {
-                        source.x = animation_frame * FIELD_WIDTH;
+        // Restored game continues immediately, without the start delay.
+        level_start = time(NULL);
+    } else if (record_file) {
+        // Replay holds one level, recorded game ends with it.
+        level = new Level(LEVELS_FILE, replay.level);
+    } else {
+        sequencer = new LevelSequencer(LEVELS_FILE, first_level);
+        level = sequencer->current();
+    }
 
-                        switch (field.type) {
-                            case FT_MURPHY:
-								if (!field.has_hint(HINT_PUSH)) {
-									source.y = 1 * FIELD_HEIGHT;
-									last_murphy_side_move = DIR_RIGHT;
-								}
-								else {
-									source.x = 0 * FIELD_WIDTH;
-									source.y = 20 * FIELD_HEIGHT;
-								}
-                                break;
+    // Journal tells whether a game step has changed anything on the screen.
+    level->enable_journal();
+    bool changed = true; /**< Level has changed since the last frame has been drawn. */
 
-                            case FT_ZONK:
-                                source.y = 3 * FIELD_HEIGHT;
-                                break;
+    if (profiler) {
+        // Restored state has no level number.
+        profiler->level(sequencer ? sequencer->current_level() : load_file ? 0 : replay.level, level->title);
+    }
 
-                            case FT_INFOTRON:
-                                source.y = 5 * FIELD_HEIGHT;
-                                break;
+    // Turbo divides the step interval, several steps done in one frame are drawn just once, in their final state.
+    int speed = 1;
+    Clock::duration step_interval = step_duration;
 
-                            case FT_SNIK_SNAK:
-                                source.y = (9 + turn_offset) * FIELD_HEIGHT;
-                                break;
+    bool cont = true;
 
-                            case FT_ELECTRON:
-                                break;
+    while (cont) {
+        Clock::time_point frame_start = Clock::now();
 
-                            default:
-                                break;
-                        }
-                    }
+        if (drawer->speed() != speed) {
+            speed = drawer->speed();
+            step_interval = step_duration / speed;
+            next_step = step_start + step_interval;
+        }
 
-                    else if (field.has_hint(HINT_FROM_RIGHT)
-                            || (field.type == FT_MURPHY && last_murphy_side_move == DIR_LEFT &&
-                                field.has_hint(HINT_FROM_TOP | HINT_FROM_BOTTOM)))
-                    {
-                        source.x = animation_frame * FIELD_WIDTH;
+        int64_t level_time = time(NULL) - level_start;
+        if (level_time < 0) {
+            // Game does not run yet, first step is done as soon as it starts.
+            step_start = next_step = frame_start;
+        } else {
+            if (frame_start - next_step > step_duration * 4) {
+                // Process has been stopped for a while, do not try to catch up.
+                next_step = frame_start;
+            }
 
-                        switch (field.type) {
-                            case FT_MURPHY:
-								if (!field.has_hint(HINT_PUSH)) {
-									source.y = 0 * FIELD_HEIGHT;
-									last_murphy_side_move = DIR_LEFT;
-								}
-								else {
-									source.x = 1 * FIELD_WIDTH;
-									source.y = 20 * FIELD_HEIGHT;
-								}
-                                break;
+            while (cont && frame_start >= next_step) {
+                if (profiler) {
+                    profiler->enter(PerfProfiler::PHASE_INPUT);
+                }
 
-                            case FT_ZONK:
-                                source.y = 2 * FIELD_HEIGHT;
-                                break;
+                cont &= drawer->handle_input(level);
 
-                            case FT_INFOTRON:
-                                source.y = 4 * FIELD_HEIGHT;
-                                break;
+                if (record_file) {
+                    replay.inputs.push_back(level->encode_input());
+                }
 
-                            case FT_SNIK_SNAK:
-                                source.y = (8 + turn_offset) * FIELD_HEIGHT;
-                                break;
+                if (profiler) {
+                    profiler->enter(PerfProfiler::PHASE_STEP);
+                }
 
-                            default:
-                                break;
-                        }
-                    }
+                bool running = level->game_step();
+                changed |= !level->changes().empty();
 
-                    else if (field.has_hint(HINT_FROM_TOP)) {
-                        source.x = animation_frame * FIELD_WIDTH;
+                if (profiler) {
+                    profiler->leave();
+                }
 
-                        switch (field.type) {
-                            case FT_SNIK_SNAK:
-                                source.y = (11 + turn_offset) * FIELD_HEIGHT;
-                                break;
+                if (record_file && keyframes > 0 && replay.inputs.size() % keyframes == 0) {
+                    replay.add_keyframe(*level);
+                }
 
-                            default:
-                                break;
-                        }
-                    }
+                if (tracer) {
+                    tracer->step(level->murphy_moved);
+                }
 
-                    else if (field.has_hint(HINT_FROM_BOTTOM)) {
-                        source.x = animation_frame * FIELD_WIDTH;
+                if (publisher) {
+                    publisher->publish_state(*level);
+                }
 
-                        switch (field.type) {
-                            case FT_SNIK_SNAK:
-                                source.y = (10 + turn_offset) * FIELD_HEIGHT;
-                                break;
+                step_start = next_step;
+                next_step += step_interval;
 
-                            default:
-                                break;
-                        }
+                if (!running) {
+                    if (!sequencer) {
+                        cont = false;
+                        break;
                     }
-                }
 
-                if (need_draw) {
-                    SDL_BlitSurface(source_surface, &source, screen, &dest);
+                    // Next level starts after the same delay as the first one.
+                    level = sequencer->advance();
+                    level->enable_journal();
+                    changed = true;
+
+                    if (profiler) {
+                        profiler->level(sequencer->current_level(), level->title);
+                    }
+                    level_start = time(NULL) + 2;
+                    break;
                 }
             }
         }
 
-        SDL_UpdateWindowSurface(window);
-    }
-
-    int animation_frames() {
-        return 8;
-    }
+        // Frame that would look like the last one is not drawn at all.
+        bool idle = !changed && !drawer->needs_redraw(level);
+        if (!idle) {
+            float phase = std::chrono::duration<float>(frame_start - step_start) / step_interval;
+            if (profiler) {
+                profiler->enter(PerfProfiler::PHASE_DRAW);
+            }
 
-protected:
-    static const int KBD_UP = 0;
-    static const int KBD_DOWN = 1;
-    static const int KBD_LEFT = 2;
-    static const int KBD_RIGHT = 3;
-    static const int KBD_SPACE = 4;
+            drawer->draw(level, std::min(phase, 1.0f));
+            changed = false;
 
-    SDL_Window *window;
-    SDL_Surface *fixed;
-    SDL_Surface *moving;
+            if (profiler) {
+                profiler->leave();
+            }
+        }
 
-    int keyboard_down[5];
-    Direction last_murphy_side_move;
+        if (fps > 0 || idle) {
+            // Wake up for the next frame, or earlier when the next step is due before it. Idle screen waits just for
+            // the next step, or for the drawer's events. Turbo steps wait for the next frame, which does all of them.
+            Clock::duration frame = fps > 0 ? Clock::duration(std::chrono::microseconds(1000000 / fps)) : step_interval;
+            Clock::time_point wake = frame_start + frame;
+            if (next_step > frame_start && (idle || speed == 1)) {
+                wake = idle ? next_step : std::min(wake, next_step);
+            }
 
-    bool has_animation(Field field) {
-        if (field.has_hint(HINT_EXPLOSION)
-            || field.has_hint(HINT_FROM_LEFT | HINT_FROM_RIGHT | HINT_FROM_TOP | HINT_FROM_BOTTOM))
-        {
-            return true;
+            if (wake > Clock::now()) {
+                drawer->wait(wake);
+            }
         }
+    }
 
-        return false;
+    delete drawer;
+
+    if (sequencer) {
+        delete sequencer;
+    } else {
+        delete level;
     }
-};
 
-int main(int argc, char **argv) {
-    Level *level = new Level("LEVELS.DAT", 1);
-    Drawer *drawer = new SDLDrawer();
+    if (publisher) {
+        if (publisher->skipped_frames() > 0) {
+            fprintf(stderr, "%d frames did not fit the frame ring after the window was resized.\n", publisher->skipped_frames());
+        }
 
-    bool cont = true;
-    time_t level_start = time(NULL) + 2;
-    int animation_frame = 0;
+        delete publisher;
+    }
 
-	std::chrono::time_point<std::chrono::high_resolution_clock> tm_start;
-	std::chrono::time_point<std::chrono::high_resolution_clock> tm_end;
+#if CELL_TRACE
+    if (dump_trace && !CellTrace::dump(dump_trace)) {
+        fprintf(stderr, "Unable to write cell trace to %s.\n", dump_trace);
+    }
+#endif
 
-    while (cont) {
-		tm_start = std::chrono::high_resolution_clock::now();
+    if (record_file && !replay.write(record_file)) {
+        fprintf(stderr, "Unable to write replay to %s.\n", record_file);
+    }
 
-        int64_t level_time = time(NULL) - level_start;
-        if (level_time >= 0) {
-            if (animation_frame == 0) {
-                cont &= drawer->handle_input(level);
-                cont &= level->game_step();
-            }
+    if (tracer) {
+        tracer->report(stdout);
+
+        if (trace_json && !tracer->write_chrome_trace(trace_json)) {
+            fprintf(stderr, "Unable to write trace to %s.\n", trace_json);
         }
 
-        drawer->draw(level, animation_frame);
+        delete tracer;
+    }
+
+    if (profiler) {
+        profiler->report(stdout);
 
-        animation_frame = (animation_frame + 1) % drawer->animation_frames();
+        if (profile_json && !profiler->write_json(profile_json)) {
+            fprintf(stderr, "Unable to write profile to %s.\n", profile_json);
+        }
 
-		tm_end = std::chrono::high_resolution_clock::now();
-		auto lasted = std::chrono::duration_cast<std::chrono::milliseconds>(tm_end - tm_start);
-		std::this_thread::sleep_for(std::chrono::milliseconds(1000) / FPS - lasted);
+        delete profiler;
     }
 
     return EXIT_SUCCESS;
@@ -0,0 +1,253 @@
+#ifndef SUPAPLEX_SHM_RING_H
+#define SUPAPLEX_SHM_RING_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <atomic>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Ring buffer in POSIX shared memory with one writer and any number of readers.
+ *
+ * Every slot is guarded by a sequence lock. Writer makes the sequence odd before it starts to write entry into the
+ * slot and even when the entry is complete. Reader checks the sequence before and after it has used the entry, and
+ * throws away what it has read when the sequence changed in between. Writer never waits for readers, slow reader
+ * just misses entries.
+ */
+
+static const uint32_t SHM_RING_MAGIC = 0x52505053; /**< "SPPR" */
+static const uint32_t SHM_RING_VERSION = 1;
+
+/**
+ * Default names of shared memory objects published by the game.
+ */
+static const char *const SHM_STATE_NAME = "/supaplex-state";
+static const char *const SHM_FRAME_NAME = "/supaplex-frame";
+
+struct ShmRingHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t slot_count;
+    uint32_t slot_size;               /**< Bytes of one slot, including ShmSlotHeader. */
+    std::atomic<uint64_t> published;  /**< Number of published entries, entry n is in slot n % slot_count. */
+};
+
+struct ShmSlotHeader {
+    std::atomic<uint64_t> sequence;   /**< 2n + 1 while entry n is written, 2n + 2 when it is complete. */
+    uint32_t size;                    /**< Bytes of payload. */
+    uint32_t reserved;
+};
+
+/**
+ * Game state after one game step.
+ */
+struct ShmStatePayload {
+    static const int WIDTH = 60;
+    static const int HEIGHT = 24;
+
+    uint64_t step;
+    int32_t murphy_x;
+    int32_t murphy_y;
+    uint8_t murphy_alive;
+    uint8_t reserved[3];
+    int32_t infotrons_collected;
+    uint8_t types[WIDTH * HEIGHT];   /**< FieldType of every field. */
+    uint16_t hints[WIDTH * HEIGHT];  /**< Hints of every field. */
+};
+
+/**
+ * Rendered frame, pixels follow the header.
+ */
+struct ShmFramePayload {
+    uint64_t frame;
+    int32_t width;
+    int32_t height;
+    int32_t pitch;
+    uint32_t pixel_format;  /**< SDL pixel format. */
+};
+
+class ShmRingWriter {
+public:
+    ShmRingWriter(): header(nullptr), mapped_size(0) {}
+
+    ~ShmRingWriter() {
+        if (header) {
+            munmap(header, mapped_size);
+            shm_unlink(name);
+        }
+    }
+
+    ShmRingWriter(const ShmRingWriter &) = delete;
+    ShmRingWriter &operator=(const ShmRingWriter &) = delete;
+
+    /**
+     * Create (or replace) shared memory object with slot_count slots for payloads up to payload_size bytes.
+     */
+    bool create(const char *shm_name, uint32_t slot_count, uint32_t payload_size) {
+        strncpy(name, shm_name, sizeof(name) - 1);
+        name[sizeof(name) - 1] = '\0';
+
+        uint32_t slot_size = (sizeof(ShmSlotHeader) + payload_size + 63) & ~63u;
+        size_t size = 64 + (size_t)slot_size * slot_count;
+
+        shm_unlink(name);
+        int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (fd < 0) {
+            return false;
+        }
+
+        void *mapped = MAP_FAILED;
+        if (ftruncate(fd, size) == 0) {
+            mapped = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+
+        if (mapped == MAP_FAILED) {
+            shm_unlink(name);
+            return false;
+        }
+
+        header = (ShmRingHeader *)mapped;
+        mapped_size = size;
+
+        header->slot_count = slot_count;
+        header->slot_size = slot_size;
+        header->published.store(0, std::memory_order_relaxed);
+        header->version = SHM_RING_VERSION;
+        std::atomic_thread_fence(std::memory_order_release);
+        header->magic = SHM_RING_MAGIC;
+
+        return true;
+    }
+
+    uint32_t capacity() const {
+        return header->slot_size - sizeof(ShmSlotHeader);
+    }
+
+    /**
+     * Start writing next entry, return where its payload goes.
+     */
+    void *begin() {
+        uint64_t n = header->published.load(std::memory_order_relaxed);
+        ShmSlotHeader *slot = slot_at(n);
+
+        slot->sequence.store(2 * n + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+
+        return slot + 1;
+    }
+
+    /**
+     * Publish the entry started by begin().
+     */
+    void commit(uint32_t size) {
+        uint64_t n = header->published.load(std::memory_order_relaxed);
+        ShmSlotHeader *slot = slot_at(n);
+
+        slot->size = size;
+        slot->sequence.store(2 * n + 2, std::memory_order_release);
+        header->published.store(n + 1, std::memory_order_release);
+    }
+
+protected:
+    char name[64];
+    ShmRingHeader *header;
+    size_t mapped_size;
+
+    ShmSlotHeader *slot_at(uint64_t n) {
+        return (ShmSlotHeader *)((uint8_t *)header + 64 + (size_t)header->slot_size * (n % header->slot_count));
+    }
+};
+
+class ShmRingReader {
+public:
+    ShmRingReader(): header(nullptr), mapped_size(0) {}
+
+    ~ShmRingReader() {
+        if (header) {
+            munmap((void *)header, mapped_size);
+        }
+    }
+
+    ShmRingReader(const ShmRingReader &) = delete;
+    ShmRingReader &operator=(const ShmRingReader &) = delete;
+
+    bool open(const char *name) {
+        int fd = shm_open(name, O_RDONLY, 0);
+        if (fd < 0) {
+            return false;
+        }
+
+        struct stat st;
+        void *mapped = MAP_FAILED;
+        if (fstat(fd, &st) == 0 && st.st_size >= (off_t)sizeof(ShmRingHeader)) {
+            mapped = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+        }
+
+        close(fd);
+
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+
+        header = (const ShmRingHeader *)mapped;
+        mapped_size = st.st_size;
+
+        if (header->magic != SHM_RING_MAGIC || header->version != SHM_RING_VERSION
+            || 64 + (size_t)header->slot_size * header->slot_count > mapped_size)
+        {
+            munmap(mapped, mapped_size);
+            header = nullptr;
+            return false;
+        }
+
+        return true;
+    }
+
+    /**
+     * Number of entries published so far.
+     */
+    uint64_t published() const {
+        return header->published.load(std::memory_order_acquire);
+    }
+
+    uint32_t slot_count() const {
+        return header->slot_count;
+    }
+
+    /**
+     * Use entry n in place: consumer(payload, size) is called with pointer into the shared memory. Return false when
+     * the entry is not available (not yet published or already overwritten) or has been overwritten while consumer
+     * was using it, in which case everything the consumer has read must be thrown away. Size never exceeds the slot,
+     * but it may be garbage as well as the payload, consumer must not read past it.
+     */
+    template <class Consumer>
+    bool consume(uint64_t n, Consumer consumer) const {
+        const ShmSlotHeader *slot = (const ShmSlotHeader *)((const uint8_t *)header + 64
+            + (size_t)header->slot_size * (n % header->slot_count));
+
+        uint64_t before = slot->sequence.load(std::memory_order_acquire);
+        if (before != 2 * n + 2) {
+            return false;
+        }
+
+        uint32_t capacity = header->slot_size - sizeof(ShmSlotHeader);
+        uint32_t size = slot->size;
+        consumer((const void *)(slot + 1), size < capacity ? size : capacity);
+
+        std::atomic_thread_fence(std::memory_order_acquire);
+        return slot->sequence.load(std::memory_order_relaxed) == before;
+    }
+
+protected:
+    const ShmRingHeader *header;
+    size_t mapped_size;
+};
+
+#endif
@@ -0,0 +1,98 @@
+/**
+ * Example consumer of the state (and frames) published by `supaplex --publish`.
+ *
+ * Prints one line for every game step it manages to read. Build with `make tools`.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <chrono>
+#include <thread>
+
+#include "../shm_ring.h"
+
+static int count_type(const ShmStatePayload &state, uint8_t type) {
+    int count = 0;
+    for (int i = 0; i < ShmStatePayload::WIDTH * ShmStatePayload::HEIGHT; ++i) {
+        count += state.types[i] == type;
+    }
+    return count;
+}
+
+int main(int argc, char **argv) {
+    bool frames = argc > 1 && strcmp(argv[1], "--frames") == 0;
+    const char *name = frames ? SHM_FRAME_NAME : SHM_STATE_NAME;
+
+    ShmRingReader reader;
+    while (!reader.open(name)) {
+        fprintf(stderr, "Waiting for %s...\n", name);
+        std::this_thread::sleep_for(std::chrono::seconds(1));
+    }
+
+    uint64_t next = reader.published();
+    uint64_t missed = 0;
+
+    while (true) {
+        uint64_t published = reader.published();
+        if (next >= published) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+            continue;
+        }
+
+        // Entries older than the ring size are overwritten already, jump to the oldest one still there.
+        if (published - next > reader.slot_count()) {
+            missed += published - next - reader.slot_count();
+            next = published - reader.slot_count();
+        }
+
+        if (frames) {
+            ShmFramePayload frame;
+            uint32_t checksum = 0;
+
+            bool ok = reader.consume(next, [&](const void *payload, uint32_t size) {
+                if (size < sizeof(frame)) {
+                    memset(&frame, 0, sizeof(frame));
+                    return;
+                }
+
+                memcpy(&frame, payload, sizeof(frame));
+
+                // Header may be overwritten while it is copied, pixels are read only within the payload size.
+                const uint8_t *pixels = (const uint8_t *)payload + sizeof(ShmFramePayload);
+                int64_t pixels_size = size - sizeof(ShmFramePayload);
+                for (int64_t y = 0; frame.pitch > 0 && y < frame.height && y * frame.pitch < pixels_size; y += 8) {
+                    checksum = checksum * 31 + pixels[y * frame.pitch];
+                }
+            });
+
+            if (ok) {
+                printf("frame %llu %dx%d checksum %08x missed %llu\n", (unsigned long long)frame.frame,
+                    frame.width, frame.height, checksum, (unsigned long long)missed);
+            } else {
+                ++missed;
+            }
+        } else {
+            ShmStatePayload state;
+
+            // Copy out, so the state can be used after the slot is released.
+            bool ok = reader.consume(next, [&](const void *payload, uint32_t size) {
+                memcpy(&state, payload, size < sizeof(state) ? size : sizeof(state));
+            });
+
+            if (ok) {
+                printf("step %llu murphy [%dx%d] %s infotrons %d (%d left) missed %llu\n",
+                    (unsigned long long)state.step, state.murphy_x, state.murphy_y,
+                    state.murphy_alive ? "alive" : "dead", state.infotrons_collected, count_type(state, 4),
+                    (unsigned long long)missed);
+            } else {
+                ++missed;
+            }
+        }
+
+        fflush(stdout);
+        ++next;
+    }
+
+    return EXIT_SUCCESS;
+}